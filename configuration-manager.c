@@ -19,66 +19,192 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <sqlite3.h>
 
 #include "database-connection-utils.h"
 #include "configuration-manager.h"
 
+static bool
+valid_default_mode (Mode default_mode)
+{
+  return default_mode >= 0 && default_mode <= MODE_LAST;
+}
+
+static bool
+valid_notification_time (int notification_time)
+{
+  return notification_time >= 0 && notification_time <= MAX_NOTIFICATION_TIME;
+}
+
+// Fields whose values differ from the current ones
+static unsigned int
+changed_fields (const Config *current,
+                const Config *config,
+                unsigned int  fields)
+{
+  unsigned int changed = 0;
+
+  if ((fields & CONFIG_FIELD_LOCALTIME) && config->use_localtime != current->use_localtime)
+    changed |= CONFIG_FIELD_LOCALTIME;
+  if ((fields & CONFIG_FIELD_DEFAULT_MODE) && config->default_mode != current->default_mode)
+    changed |= CONFIG_FIELD_DEFAULT_MODE;
+  if ((fields & CONFIG_FIELD_NOTIFICATION_TIME) && config->notification_time != current->notification_time)
+    changed |= CONFIG_FIELD_NOTIFICATION_TIME;
+  if ((fields & CONFIG_FIELD_SHUTDOWN_FAIL) && config->shutdown_fail != current->shutdown_fail)
+    changed |= CONFIG_FIELD_SHUTDOWN_FAIL;
+
+  return changed;
+}
+
+static int
+set (DatabaseConnection *connection,
+     const Config       *config,
+     unsigned int        fields)
+{
+  sqlite3_stmt *stmt;
+  Config current;
+  unsigned int changed;
+  bool own_transaction;
+
+  if (fields & ~CONFIG_FIELD_ALL
+      || ((fields & CONFIG_FIELD_DEFAULT_MODE) && !valid_default_mode (config->default_mode))
+      || ((fields & CONFIG_FIELD_NOTIFICATION_TIME) && !valid_notification_time (config->notification_time)))
+    {
+      fprintf (stderr, "Invalid configuration values\n");
+      return EXIT_FAILURE;
+    }
+
+  connection = utils_get_connection (connection);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Database not connected\n");
+      return EXIT_FAILURE;
+    }
+
+  // Join the caller's transaction, if any
+  own_transaction = sqlite3_get_autocommit (connection->db);
+  if (own_transaction
+      && utils_run_statement (connection,
+                              utils_get_statement (connection, STATEMENT_BEGIN_IMMEDIATE, TABLE_LAST))
+         == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  // Compared while holding the write lock, so it can't change in between
+  if (configuration_get_all (connection, &current) == EXIT_FAILURE)
+    goto error;
+
+  changed = changed_fields (&current, config, fields);
+  if (changed != 0)
+    {
+      stmt = utils_get_statement (connection, STATEMENT_CONFIG_SET, TABLE_LAST);
+      if (stmt == NULL)
+        goto error;
+
+      // Unbound (NULL) parameters keep the current values
+      if (changed & CONFIG_FIELD_LOCALTIME)
+        sqlite3_bind_int (stmt, 1, config->use_localtime);
+      if (changed & CONFIG_FIELD_DEFAULT_MODE)
+        sqlite3_bind_int (stmt, 2, config->default_mode);
+      if (changed & CONFIG_FIELD_NOTIFICATION_TIME)
+        sqlite3_bind_int (stmt, 3, config->notification_time);
+      if (changed & CONFIG_FIELD_SHUTDOWN_FAIL)
+        sqlite3_bind_int (stmt, 4, config->shutdown_fail);
+
+      if (utils_run_statement (connection, stmt) == EXIT_FAILURE)
+        goto error;
+    }
+
+  if (own_transaction
+      && utils_run_statement (connection,
+                              utils_get_statement (connection, STATEMENT_COMMIT, TABLE_LAST))
+         == EXIT_FAILURE)
+    goto error;
+
+  return EXIT_SUCCESS;
+
+error:
+  if (own_transaction && !sqlite3_get_autocommit (connection->db))
+    utils_run_statement (connection,
+                         utils_get_statement (connection, STATEMENT_ROLLBACK, TABLE_LAST));
+  return EXIT_FAILURE;
+}
+
+int
+configuration_set (DatabaseConnection *connection,
+                   const Config       *config,
+                   unsigned int        fields)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_CONFIG_SET);
+  int ret = set (connection, config, fields);
+
+  profile_end (connection, previous);
+  return ret;
+}
+
+int
+configuration_set_all (DatabaseConnection *connection,
+                       const Config       *config)
+{
+  return configuration_set (connection, config, CONFIG_FIELD_ALL);
+}
+
 int
 configuration_set_localtime (bool use_localtime)
 {
-  sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                    "UPDATE config "\
-                    "SET localtime = %d "\
-                    "WHERE id = 1;",
-                    use_localtime);
+  return configuration_set_localtime_full (NULL, use_localtime);
+}
+
+int
+configuration_set_localtime_full (DatabaseConnection *connection,
+                                  bool use_localtime)
+{
+  Config config = { .use_localtime = use_localtime };
 
-  return utils_run_sql ();
+  return configuration_set (connection, &config, CONFIG_FIELD_LOCALTIME);
 }
 
 int
 configuration_set_default_mode (Mode default_mode)
 {
-  // Validate mode
-  if (default_mode >= 0 && default_mode <= MODE_LAST)
-    {
-      sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                        "UPDATE config "\
-                        "SET default_mode = %d "\
-                        "WHERE id = 1;",
-                        default_mode);
+  return configuration_set_default_mode_full (NULL, default_mode);
+}
 
-      return utils_run_sql ();
-    }
-  else
-    return EXIT_FAILURE;
+int
+configuration_set_default_mode_full (DatabaseConnection *connection,
+                                     Mode default_mode)
+{
+  Config config = { .default_mode = default_mode };
+
+  return configuration_set (connection, &config, CONFIG_FIELD_DEFAULT_MODE);
 }
 
 int
 configuration_set_notification_time (int notification_time)
 {
-  if (notification_time >= 0 && notification_time <= MAX_NOTIFICATION_TIME)
-    {
-      sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                        "UPDATE config "\
-                        "SET notification_time = %d "\
-                        "WHERE id = 1;",
-                        notification_time);
+  return configuration_set_notification_time_full (NULL, notification_time);
+}
 
-      return utils_run_sql ();
-    }
-  else
-    return EXIT_FAILURE;
+int
+configuration_set_notification_time_full (DatabaseConnection *connection,
+                                          int notification_time)
+{
+  Config config = { .notification_time = notification_time };
+
+  return configuration_set (connection, &config, CONFIG_FIELD_NOTIFICATION_TIME);
 }
 
 int
 configuration_set_shutdown_fail (bool shutdown_fail)
 {
-  sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                    "UPDATE config "\
-                    "SET shutdown_fail = %d "\
-                    "WHERE id = 1;",
-                    shutdown_fail);
+  return configuration_set_shutdown_fail_full (NULL, shutdown_fail);
+}
+
+int
+configuration_set_shutdown_fail_full (DatabaseConnection *connection,
+                                      bool shutdown_fail)
+{
+  Config config = { .shutdown_fail = shutdown_fail };
 
-  return utils_run_sql ();
+  return configuration_set (connection, &config, CONFIG_FIELD_SHUTDOWN_FAIL);
 }
@@ -22,10 +22,38 @@
 #define CONFIGURATION_MANAGER_H_
 
 #include "gawake-types.h"
+#include "configuration-reader.h"
+
+// Fields of Config, for partial updates
+typedef enum
+{
+  CONFIG_FIELD_LOCALTIME          = 1 << 0,
+  CONFIG_FIELD_DEFAULT_MODE       = 1 << 1,
+  CONFIG_FIELD_NOTIFICATION_TIME  = 1 << 2,
+  CONFIG_FIELD_SHUTDOWN_FAIL      = 1 << 3,
+  CONFIG_FIELD_ALL                = 0xF
+} ConfigField;
+
+/*
+ * Writes the "fields" (ConfigField mask) of "config" at once: all of them
+ * are validated first, then written by a single statement in a single
+ * transaction; nothing is written if they already have these values.
+ * Pass NULL as connection to use the default connection.
+ */
+int configuration_set (DatabaseConnection *connection,
+                       const Config       *config,
+                       unsigned int        fields);
+int configuration_set_all (DatabaseConnection *connection,
+                           const Config       *config);
 
 int configuration_set_localtime (bool use_localtime);
 int configuration_set_default_mode (Mode default_mode);
 int configuration_set_notification_time (int notification_time);
 int configuration_set_shutdown_fail (bool shutdown_fail);
 
+int configuration_set_localtime_full (DatabaseConnection *connection, bool use_localtime);
+int configuration_set_default_mode_full (DatabaseConnection *connection, Mode default_mode);
+int configuration_set_notification_time_full (DatabaseConnection *connection, int notification_time);
+int configuration_set_shutdown_fail_full (DatabaseConnection *connection, bool shutdown_fail);
+
 #endif /* CONFIGURATION_MANAGER_H_ */
@@ -25,15 +25,7 @@
 #include "database-connection-utils.h"
 #include "configuration-reader.h"
 
-typedef struct
-{
-  bool use_localtime;
-  Mode default_mode;
-  int notification_time;
-  bool shutdown_fail;
-} Config;
-
-static Config config =
+static const Config DEFAULT_CONFIG =
 {
   false,
   MODE_OFF,
@@ -42,24 +34,20 @@ static Config config =
 };
 
 static int
-get_config (void)
+read_config (DatabaseConnection *connection,
+             Config             *config)
 {
   // Database related variables
   int rc;
   struct sqlite3_stmt *stmt;
 
-  // Generate SQL
-  sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                    "SELECT * FROM config "\
-                    "WHERE id = 1;");
-
-  DEBUG_PRINT (("Generated SQL:\n\t%s", utils_get_sql ()));
+  *config = DEFAULT_CONFIG;
 
-  if (sqlite3_prepare_v2 (utils_get_pdb (), utils_get_sql (), -1, &stmt, NULL) != SQLITE_OK)
+  stmt = utils_get_statement (connection, STATEMENT_CONFIG_GET, TABLE_LAST);
+  if (stmt == NULL)
     {
       DEBUG_PRINT_CONTEX;
-      fprintf (stderr, "ERROR: Failed to query rule\n");
-      sqlite3_finalize (stmt);
+      fprintf (stderr, "ERROR: Failed to query the configuration\n");
       return EXIT_FAILURE;
     }
 
@@ -69,36 +57,97 @@ get_config (void)
       // Note: column 1 is the cli_version
 
       // Use localtime
-      config.use_localtime = (bool) sqlite3_column_int (stmt, 2);
+      config->use_localtime = (bool) sqlite3_column_int (stmt, 2);
 
       // Default mode
-      config.default_mode = (Mode) sqlite3_column_int (stmt, 3);
+      config->default_mode = (Mode) sqlite3_column_int (stmt, 3);
 
       // Notification time
-      config.notification_time = sqlite3_column_int (stmt, 4);
+      config->notification_time = sqlite3_column_int (stmt, 4);
 
       // Shutdown if fails
-      config.shutdown_fail = (bool) sqlite3_column_int (stmt, 5);
+      config->shutdown_fail = (bool) sqlite3_column_int (stmt, 5);
     }
 
   if (rc != SQLITE_DONE)
     {
       DEBUG_PRINT_CONTEX;
-      /* TODO */
-      /* fprintf (stderr, "ERROR (failed to query rule): %s\n"), sqlite3_errmsg (utils_get_pdb ()); */
-      sqlite3_finalize (stmt);
+      fprintf (stderr, "ERROR (failed to query the configuration): %s\n",
+               sqlite3_errmsg (sqlite3_db_handle (stmt)));
+      sqlite3_reset (stmt);
+      *config = DEFAULT_CONFIG;
+      return EXIT_FAILURE;
+    }
+
+  sqlite3_reset (stmt);
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * The snapshot is valid while PRAGMA data_version (changes made by other
+ * connections) and config_writes (bumped by the update hook on each change
+ * made by this connection, even if not committed yet) stay the same
+ */
+static int
+get_all (DatabaseConnection *connection,
+         Config             *config)
+{
+  int64_t data_version;
+
+  *config = DEFAULT_CONFIG;
+
+  connection = utils_get_connection (connection);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Database not connected\n");
       return EXIT_FAILURE;
     }
 
-  sqlite3_finalize(stmt);
+  if (utils_get_data_version (connection, &data_version) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  if (!connection->config_valid
+      || connection->config_data_version != data_version
+      || connection->config_read_writes != connection->config_writes)
+    {
+      connection->config_valid = false;
+      if (read_config (connection, &connection->config) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+      connection->config_valid = true;
+      connection->config_data_version = data_version;
+      connection->config_read_writes = connection->config_writes;
+    }
+
+  *config = connection->config;
 
   return EXIT_SUCCESS;
 }
 
+int
+configuration_get_all (DatabaseConnection *connection,
+                       Config             *config)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_CONFIG_GET);
+  int ret = get_all (connection, config);
+
+  profile_end (connection, previous);
+  return ret;
+}
+
 int
 configuration_get_localtime (bool *use_localtime)
 {
-  int ret = get_config ();
+  return configuration_get_localtime_full (NULL, use_localtime);
+}
+
+int
+configuration_get_localtime_full (DatabaseConnection *connection,
+                                  bool *use_localtime)
+{
+  Config config;
+  int ret = configuration_get_all (connection, &config);
   *use_localtime = config.use_localtime;
   return ret;
 }
@@ -106,7 +155,15 @@ configuration_get_localtime (bool *use_localtime)
 int
 configuration_get_default_mode (Mode *default_mode)
 {
-  int ret = get_config ();
+  return configuration_get_default_mode_full (NULL, default_mode);
+}
+
+int
+configuration_get_default_mode_full (DatabaseConnection *connection,
+                                     Mode *default_mode)
+{
+  Config config;
+  int ret = configuration_get_all (connection, &config);
   *default_mode = config.default_mode;
   return ret;
 }
@@ -114,7 +171,15 @@ configuration_get_default_mode (Mode *default_mode)
 int
 configuration_get_notification_time (int *notification_time)
 {
-  int ret = get_config ();
+  return configuration_get_notification_time_full (NULL, notification_time);
+}
+
+int
+configuration_get_notification_time_full (DatabaseConnection *connection,
+                                          int *notification_time)
+{
+  Config config;
+  int ret = configuration_get_all (connection, &config);
   *notification_time = config.notification_time;
   return ret;
 }
@@ -122,7 +187,15 @@ configuration_get_notification_time (int *notification_time)
 int
 configuration_get_shutdown_fail (bool *shutdown_fail)
 {
-  int ret = get_config ();
+  return configuration_get_shutdown_fail_full (NULL, shutdown_fail);
+}
+
+int
+configuration_get_shutdown_fail_full (DatabaseConnection *connection,
+                                      bool *shutdown_fail)
+{
+  Config config;
+  int ret = configuration_get_all (connection, &config);
   *shutdown_fail = config.shutdown_fail;
   return ret;
 }
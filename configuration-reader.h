@@ -23,9 +23,29 @@
 
 #include "gawake-types.h"
 
+typedef struct
+{
+  bool use_localtime;
+  Mode default_mode;
+  int notification_time;
+  bool shutdown_fail;
+} Config;
+
+/*
+ * All the settings at once, from a snapshot cached by the connection: the
+ * config table is only read again after it changes (on this connection or
+ * another one). Pass NULL as connection to use the default connection.
+ */
+int configuration_get_all (DatabaseConnection *connection, Config *config);
+
 int configuration_get_localtime (bool *use_localtime);
 int configuration_get_default_mode (Mode *default_mode);
 int configuration_get_notification_time (int *notification_time);
 int configuration_get_shutdown_fail (bool *shutdown_fail);
 
+int configuration_get_localtime_full (DatabaseConnection *connection, bool *use_localtime);
+int configuration_get_default_mode_full (DatabaseConnection *connection, Mode *default_mode);
+int configuration_get_notification_time_full (DatabaseConnection *connection, int *notification_time);
+int configuration_get_shutdown_fail_full (DatabaseConnection *connection, bool *shutdown_fail);
+
 #endif /* CONFIGURATION_READER_H_ */
@@ -19,56 +19,273 @@
  */
 
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <sqlite3.h>
 
 #include "database-connection-utils.h"
 #include "debugger.h"
 
-static sqlite3 *db = NULL;
-static char sql[SQL_SIZE];
+/*
+ * Rule queries: the filtered rows get a sort key, and pages continue after
+ * the (sort_key, id) of the last row of the previous one (keyset pagination)
+ *  ?1: active only; ?2: mask of week days, 0 for any; ?3, ?4: time range
+ *  ?5, ?6: name range (a blob is bigger than any text); ?7, ?8: last sort
+ *  key and id; ?9: minute of the week of now; ?10: page size
+ */
+#define RULE_QUERY(table, sort_key) \
+  "SELECT * FROM (SELECT *, " sort_key " AS sort_key FROM " table " " \
+  "WHERE active >= ?1 AND (?2 = 0 OR days & ?2 != 0) " \
+  "AND rule_minute BETWEEN ?3 AND ?4 " \
+  "AND rule_name >= ?5 AND rule_name < ?6) " \
+  "WHERE (sort_key, id) > (?7, ?8) " \
+  "ORDER BY sort_key, id LIMIT ?10;"
 
-int
-utils_run_sql (void)
+// Minutes from now (?9) to the occurrence on a week day, in [1, 10080]
+#define NEXT_FIRE_ON(day, bit) \
+  "CASE WHEN days & " bit " THEN (" day " * 1440 + rule_minute - ?9 + 10079) % 10080 + 1 ELSE 100000 END"
+#define NEXT_FIRE \
+  "min(" NEXT_FIRE_ON ("0", "1") ", " NEXT_FIRE_ON ("1", "2") ", " NEXT_FIRE_ON ("2", "4") ", " \
+  NEXT_FIRE_ON ("3", "8") ", " NEXT_FIRE_ON ("4", "16") ", " NEXT_FIRE_ON ("5", "32") ", " \
+  NEXT_FIRE_ON ("6", "64") ")"
+
+static DatabaseConnection *default_connection = NULL;
+
+static atomic_bool writer_open = false;
+
+// SQL of each cached statement; NULL where the operation doesn't apply to the table
+static const char *STATEMENT_SQL[STATEMENT_LAST][TABLE_LAST + 1] =
 {
-  int rc;
-  char *err_msg = 0;
+  [STATEMENT_RULE_GET_SINGLE] = {
+    [TABLE_ON]  = "SELECT * FROM rules_turnon WHERE id = ?1;",
+    [TABLE_OFF] = "SELECT * FROM rules_turnoff WHERE id = ?1;",
+  },
+  [STATEMENT_RULE_GET_ALL] = {
+    [TABLE_ON]  = "SELECT * FROM rules_turnon;",
+    [TABLE_OFF] = "SELECT * FROM rules_turnoff;",
+  },
+  // ?1: only active rules; ?2: mask of week days (bit 0: Sunday), 0 for any
+  [STATEMENT_RULE_FOREACH] = {
+    [TABLE_ON]  = "SELECT * FROM rules_turnon "\
+                  "WHERE (?1 = 0 OR active = 1) AND (?2 = 0 OR days & ?2 != 0);",
+    [TABLE_OFF] = "SELECT * FROM rules_turnoff "\
+                  "WHERE (?1 = 0 OR active = 1) AND (?2 = 0 OR days & ?2 != 0);",
+  },
+  [STATEMENT_RULE_QUERY_ID] = {
+    [TABLE_ON]  = RULE_QUERY ("rules_turnon", "id"),
+    [TABLE_OFF] = RULE_QUERY ("rules_turnoff", "id"),
+  },
+  [STATEMENT_RULE_QUERY_TIME] = {
+    [TABLE_ON]  = RULE_QUERY ("rules_turnon", "rule_minute"),
+    [TABLE_OFF] = RULE_QUERY ("rules_turnoff", "rule_minute"),
+  },
+  [STATEMENT_RULE_QUERY_NEXT_FIRE] = {
+    [TABLE_ON]  = RULE_QUERY ("rules_turnon", NEXT_FIRE),
+    [TABLE_OFF] = RULE_QUERY ("rules_turnoff", NEXT_FIRE),
+  },
+  [STATEMENT_RULE_ADD] = {
+    [TABLE_ON]  = "INSERT INTO rules_turnon "\
+                  "(rule_name, rule_minute, days, active) "\
+                  "VALUES (?1, ?2, ?3, ?4);",
+    [TABLE_OFF] = "INSERT INTO rules_turnoff "\
+                  "(rule_name, rule_minute, days, active, mode) "\
+                  "VALUES (?1, ?2, ?3, ?4, ?5);",
+  },
+  [STATEMENT_RULE_EDIT] = {
+    [TABLE_ON]  = "UPDATE rules_turnon SET "\
+                  "rule_name = ?1, rule_minute = ?2, days = ?3, "\
+                  "active = ?4 WHERE id = ?6;",
+    [TABLE_OFF] = "UPDATE rules_turnoff SET "\
+                  "rule_name = ?1, rule_minute = ?2, days = ?3, "\
+                  "active = ?4, mode = ?5 WHERE id = ?6;",
+  },
+  [STATEMENT_RULE_DELETE] = {
+    [TABLE_ON]  = "DELETE FROM rules_turnon WHERE id = ?1;",
+    [TABLE_OFF] = "DELETE FROM rules_turnoff WHERE id = ?1;",
+  },
+  [STATEMENT_RULE_ENABLE_DISABLE] = {
+    [TABLE_ON]  = "UPDATE rules_turnon SET active = ?2 WHERE id = ?1;",
+    [TABLE_OFF] = "UPDATE rules_turnoff SET active = ?2 WHERE id = ?1;",
+  },
+  // Source of the rules index, see rule-index.c
+  [STATEMENT_UPCOMING_RULES] = {
+    [TABLE_ON]  = "SELECT id, rule_minute, days FROM rules_turnon "\
+                  "WHERE active = 1 AND days != 0;",
+    [TABLE_OFF] = "SELECT id, rule_minute, days, mode FROM rules_turnoff "\
+                  "WHERE active = 1 AND days != 0;",
+  },
+  [STATEMENT_CUSTOM_SCHEDULE] = {
+    [TABLE_LAST] = "UPDATE custom_schedule "\
+                   "SET hour = ?1, minutes = ?2, "\
+                   "day = ?3, month = ?4, year = ?5, "\
+                   "mode = ?6 "\
+                   "WHERE id = 1;",
+  },
+  [STATEMENT_CONFIG_GET] = {
+    [TABLE_LAST] = "SELECT * FROM config WHERE id = 1;",
+  },
+  // NULL parameters keep the current value
+  [STATEMENT_CONFIG_SET] = {
+    [TABLE_LAST] = "UPDATE config SET "\
+                   "localtime = coalesce(?1, localtime), "\
+                   "default_mode = coalesce(?2, default_mode), "\
+                   "notification_time = coalesce(?3, notification_time), "\
+                   "shutdown_fail = coalesce(?4, shutdown_fail) "\
+                   "WHERE id = 1;",
+  },
+  [STATEMENT_DATA_VERSION] = {
+    [TABLE_LAST] = "PRAGMA data_version;",
+  },
+  // Take the write lock upfront, so the transaction can't fail halfway with SQLITE_BUSY
+  [STATEMENT_BEGIN_IMMEDIATE] = {
+    [TABLE_LAST] = "BEGIN IMMEDIATE;",
+  },
+  [STATEMENT_COMMIT] = {
+    [TABLE_LAST] = "COMMIT;",
+  },
+  [STATEMENT_ROLLBACK] = {
+    [TABLE_LAST] = "ROLLBACK;",
+  },
+};
 
-  if (db == NULL)
+DatabaseConnection *
+utils_get_connection (DatabaseConnection *connection)
+{
+  return (connection != NULL) ? connection : default_connection;
+}
+
+DatabaseConnection **
+utils_get_default_connection (void)
+{
+  return &default_connection;
+}
+
+bool
+utils_acquire_writer (void)
+{
+  bool expected = false;
+
+  return atomic_compare_exchange_strong (&writer_open, &expected, true);
+}
+
+void
+utils_release_writer (void)
+{
+  atomic_store (&writer_open, false);
+}
+
+sqlite3_stmt *
+utils_get_statement (DatabaseConnection *connection,
+                     Statement           statement,
+                     Table               table)
+{
+  sqlite3_stmt **stmt;
+
+  connection = utils_get_connection (connection);
+  if (connection == NULL || connection->db == NULL)
     {
       fprintf (stderr, "Database not connected\n");
-      return EXIT_FAILURE;
+      return NULL;
     }
 
-  DEBUG_PRINT (("Generated SQL:\n\t%s", sql));
-
-  rc = sqlite3_exec(db, sql, NULL, 0, &err_msg);
-  if (rc != SQLITE_OK)
-    fprintf (stderr, "Failed to run SQL: %s\n", sqlite3_errmsg(db));
+  if (statement < 0 || statement >= STATEMENT_LAST
+      || table < 0 || table > TABLE_LAST
+      || STATEMENT_SQL[statement][table] == NULL)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Invalid statement\n");
+      return NULL;
+    }
 
-  sqlite3_free (err_msg);
+  stmt = &connection->statements[statement][table];
 
-  if (rc == SQLITE_OK)
+  // Prepare once; SQLITE_PREPARE_PERSISTENT tells SQLite it will be reused
+  if (*stmt == NULL)
     {
-      // TODO
-      /* trigger_update_database (); */
-      return EXIT_SUCCESS;
+      DEBUG_PRINT (("Preparing SQL:\n\t%s", STATEMENT_SQL[statement][table]));
+
+      if (sqlite3_prepare_v3 (connection->db, STATEMENT_SQL[statement][table], -1,
+                              SQLITE_PREPARE_PERSISTENT, stmt, NULL) != SQLITE_OK)
+        {
+          DEBUG_PRINT_CONTEX;
+          fprintf (stderr, "Failed to prepare SQL: %s\n", sqlite3_errmsg (connection->db));
+          sqlite3_finalize (*stmt);
+          *stmt = NULL;
+          return NULL;
+        }
     }
   else
-    return EXIT_FAILURE;
+    {
+      // Stepped and not reset yet: a caller up the stack is still reading
+      // its rows (e.g. from a rule_foreach () callback); resetting it would
+      // restart or end that loop
+      if (sqlite3_stmt_busy (*stmt))
+        {
+          DEBUG_PRINT_CONTEX;
+          fprintf (stderr, "ERROR: Statement already running\n");
+          return NULL;
+        }
+
+      sqlite3_reset (*stmt);
+      sqlite3_clear_bindings (*stmt);
+    }
+
+  return *stmt;
 }
 
-char *
-utils_get_sql (void)
+int
+utils_run_statement (DatabaseConnection *connection,
+                     sqlite3_stmt       *stmt)
 {
-  return sql;
+  int rc;
+
+  connection = utils_get_connection (connection);
+  if (connection == NULL || stmt == NULL)
+    return EXIT_FAILURE;
+
+  DEBUG_PRINT (("Running SQL:\n\t%s", sqlite3_sql (stmt)));
+
+  rc = sqlite3_step (stmt);
+  if (rc != SQLITE_DONE)
+    fprintf (stderr, "Failed to run SQL: %s\n", sqlite3_errmsg (connection->db));
+
+  sqlite3_reset (stmt);
+
+  // Changes are signaled by the commit hook (see database-notification.c)
+  if (rc == SQLITE_DONE)
+    return EXIT_SUCCESS;
+  else
+    return EXIT_FAILURE;
 }
 
-sqlite3 * utils_get_pdb (void)
+int
+utils_get_data_version (DatabaseConnection *connection,
+                        int64_t            *data_version)
 {
-  return db;
+  sqlite3_stmt *stmt = utils_get_statement (connection, STATEMENT_DATA_VERSION, TABLE_LAST);
+
+  if (stmt == NULL || sqlite3_step (stmt) != SQLITE_ROW)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to query the data version\n");
+      sqlite3_reset (stmt);
+      return EXIT_FAILURE;
+    }
+
+  *data_version = sqlite3_column_int64 (stmt, 0);
+  sqlite3_reset (stmt);
+
+  return EXIT_SUCCESS;
 }
 
-sqlite3 ** utils_get_ppdb (void)
+void
+utils_finalize_statements (DatabaseConnection *connection)
 {
-  return &db;
+  for (int i = 0; i < STATEMENT_LAST; i++)
+    {
+      for (int j = 0; j <= TABLE_LAST; j++)
+        {
+          sqlite3_finalize (connection->statements[i][j]);
+          connection->statements[i][j] = NULL;
+        }
+    }
 }
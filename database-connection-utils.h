@@ -22,14 +22,137 @@
 #define DATABASE_CONNECTION_UTILS_H_
 
 #include "gawake-types.h"
+#include "database-connection.h"
 #include "time-converter.h"
+#include "rule-index.h"
+#include "rule-occurrence.h"
+#include "database-profile.h"
+#include "configuration-reader.h"
 #include <sqlite3.h>
 
-#define SQL_SIZE 256
+// Operations that have a cached prepared statement; statements that don't
+// depend on a rules table are stored under TABLE_LAST
+typedef enum
+{
+  STATEMENT_RULE_GET_SINGLE,
+  STATEMENT_RULE_GET_ALL,
+  STATEMENT_RULE_FOREACH,
+  // Same order as RuleOrder
+  STATEMENT_RULE_QUERY_ID,
+  STATEMENT_RULE_QUERY_TIME,
+  STATEMENT_RULE_QUERY_NEXT_FIRE,
+  STATEMENT_RULE_ADD,
+  STATEMENT_RULE_EDIT,
+  STATEMENT_RULE_DELETE,
+  STATEMENT_RULE_ENABLE_DISABLE,
+  STATEMENT_UPCOMING_RULES,
+  STATEMENT_CUSTOM_SCHEDULE,
+  STATEMENT_CONFIG_GET,
+  STATEMENT_CONFIG_SET,
+  STATEMENT_DATA_VERSION,
+  STATEMENT_BEGIN_IMMEDIATE,
+  STATEMENT_COMMIT,
+  STATEMENT_ROLLBACK,
+  STATEMENT_LAST
+} Statement;
 
-int utils_run_sql (void);
-char* utils_get_sql (void);
-sqlite3* utils_get_pdb (void);
-sqlite3** utils_get_ppdb (void);
+// Statements being timed at once: nested ones run while an outer one steps
+#define PROFILE_RUNNING_MAX 4
+
+typedef struct
+{
+  sqlite3_stmt *stmt;
+  uint64_t start_ns;
+} ProfileRunning;
+
+struct _DatabaseConnection
+{
+  sqlite3 *db;
+  bool read_only;
+  bool immutable;
+  // Statements are owned by the connection, so each handle can be used
+  // by a different thread
+  sqlite3_stmt *statements[STATEMENT_LAST][TABLE_LAST + 1];
+
+  // Busy handler
+  int busy_timeout_ms;
+  int busy_initial_backoff_ms;
+  int busy_max_backoff_ms;
+  uint64_t busy_wait_us;      // time already waited by the current operation
+  unsigned int busy_seed;     // jitter
+  BusyStats busy_stats;
+
+  // Change notification
+  unsigned int uncommitted_changes;   // DatabaseChange mask of the open transaction
+  unsigned int pending_changes;       // committed, but not dispatched yet
+  bool data_version_known;
+  int64_t data_version;
+  int change_fd;                      // epoll instance of event_fd and inotify_fd
+  int event_fd;
+  int inotify_fd;
+  DatabaseChangeFunc change_func;
+  void *change_data;
+
+  // Config snapshot, see configuration_get_all ()
+  Config config;
+  bool config_valid;
+  int64_t config_data_version;
+  unsigned int config_writes;         // changes to the config table made by this connection
+  unsigned int config_read_writes;    // config_writes when the snapshot was read
+
+  // Weekly fire times of the active rules, see rule-index.c
+  RuleIndex rule_index[TABLE_LAST];
+
+  // Local time zone offsets, see rule-occurrence.c
+  TzOffsets tz_offsets;
+
+  // Statement latency histograms, see database-profile.c
+  ProfileOperation profile_operation;   // running operation
+  bool profile_traced;                  // the trace callback is registered
+  ProfileRunning profile_running[PROFILE_RUNNING_MAX];
+};
+
+// Returns the connection itself, or the default one when it's NULL
+DatabaseConnection *utils_get_connection (DatabaseConnection *connection);
+DatabaseConnection **utils_get_default_connection (void);
+
+// Only one writable handle may be open at a time in the process;
+// returns false if another one is
+bool utils_acquire_writer (void);
+void utils_release_writer (void);
+
+/*
+ * Returns the cached statement for the operation, preparing it on the first
+ * use; the statement is returned already reset and with its bindings cleared.
+ * Callers must sqlite3_reset() it when done, instead of finalizing it.
+ * Returns NULL on failure, or if the statement is still running for a
+ * caller up the stack.
+ */
+sqlite3_stmt *utils_get_statement (DatabaseConnection *connection,
+                                   Statement           statement,
+                                   Table               table);
+// Steps a statement that returns no rows and resets it
+int utils_run_statement (DatabaseConnection *connection,
+                         sqlite3_stmt       *stmt);
+void utils_finalize_statements (DatabaseConnection *connection);
+// PRAGMA data_version: changes only when other connections commit
+int utils_get_data_version (DatabaseConnection *connection,
+                            int64_t            *data_version);
+
+// database-notification.c
+void notification_init (DatabaseConnection *connection);
+void notification_finalize (DatabaseConnection *connection);
+
+// database-profile.c
+void profile_init (DatabaseConnection *connection);
+/*
+ * Accounts the statements run until profile_end () to "operation", unless
+ * an operation is already running; returns the value to pass to
+ * profile_end ()
+ */
+ProfileOperation profile_begin (DatabaseConnection *connection,
+                                ProfileOperation    operation);
+void profile_end (DatabaseConnection *connection,
+                  ProfileOperation    previous);
 
 #endif /* DATABASE_CONNECTION_UTILS_H_ */
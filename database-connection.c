@@ -24,56 +24,386 @@
 #include <stdlib.h>
 #include <pwd.h>
 #include <grp.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "database-connection.h"
 #include "database-connection-utils.h"
+#include "database-migration.h"
 #include "debugger.h"
 
-// This function connect to the database
-// Should be called once
-int
-connect_database (bool read_only)
+#define PRAGMA_ALLOC 256
+#define IMMUTABLE_URI "file:" DB_PATH "?immutable=1"
+#define WAL_PATH DB_PATH "-wal"
+
+#define BUSY_TIMEOUT_MS 5000
+#define BUSY_INITIAL_BACKOFF_MS 1
+#define BUSY_MAX_BACKOFF_MS 100
+
+static const ConnectionOptions PROFILES[CONNECTION_PROFILE_LAST] =
+{
+  [CONNECTION_PROFILE_DEFAULT] = {
+    .read_only = false,
+    .journal_mode = JOURNAL_MODE_DEFAULT,
+    .synchronous = SYNCHRONOUS_DEFAULT,
+    .temp_store = TEMP_STORE_DEFAULT,
+    .busy_timeout_ms = BUSY_TIMEOUT_MS,
+    .busy_initial_backoff_ms = BUSY_INITIAL_BACKOFF_MS,
+    .busy_max_backoff_ms = BUSY_MAX_BACKOFF_MS,
+  },
+  // Readers don't block behind writes in WAL mode, and with synchronous=NORMAL
+  // commits don't wait for an fsync (only checkpoints do)
+  [CONNECTION_PROFILE_INTERACTIVE_WRITER] = {
+    .read_only = false,
+    .journal_mode = JOURNAL_MODE_WAL,
+    .synchronous = SYNCHRONOUS_NORMAL,
+    .temp_store = TEMP_STORE_MEMORY,
+    .busy_timeout_ms = BUSY_TIMEOUT_MS,
+    .busy_initial_backoff_ms = BUSY_INITIAL_BACKOFF_MS,
+    .busy_max_backoff_ms = BUSY_MAX_BACKOFF_MS,
+  },
+  [CONNECTION_PROFILE_READ_ONLY_SCANNER] = {
+    .read_only = true,
+    .query_only = true,
+    .journal_mode = JOURNAL_MODE_DEFAULT,
+    .synchronous = SYNCHRONOUS_DEFAULT,
+    .mmap_size = 16 * 1024 * 1024,
+    .temp_store = TEMP_STORE_MEMORY,
+    .busy_timeout_ms = BUSY_TIMEOUT_MS,
+    .busy_initial_backoff_ms = BUSY_INITIAL_BACKOFF_MS,
+    .busy_max_backoff_ms = BUSY_MAX_BACKOFF_MS,
+  },
+  // Used once, when nothing else is writing (e.g. the rtcwake path at
+  // shutdown). Not immutable: that would skip the WAL file, and with it
+  // the rules committed since the last checkpoint
+  [CONNECTION_PROFILE_BOOT_ONESHOT] = {
+    .read_only = true,
+    .query_only = true,
+    .journal_mode = JOURNAL_MODE_DEFAULT,
+    .synchronous = SYNCHRONOUS_OFF,
+    .temp_store = TEMP_STORE_MEMORY,
+    .busy_timeout_ms = BUSY_TIMEOUT_MS,
+    .busy_initial_backoff_ms = BUSY_INITIAL_BACKOFF_MS,
+    .busy_max_backoff_ms = BUSY_MAX_BACKOFF_MS,
+  },
+};
+
+void
+database_connection_options_init (ConnectionOptions *options,
+                                  ConnectionProfile  profile)
+{
+  if (profile < 0 || profile >= CONNECTION_PROFILE_LAST)
+    profile = CONNECTION_PROFILE_DEFAULT;
+
+  *options = PROFILES[profile];
+}
+
+static uint64_t
+monotonic_us (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/*
+ * Called by SQLite when the database is locked; "count" is the number of
+ * times it was already called for the same operation.
+ * Returns 0 to give up (the operation fails with SQLITE_BUSY) or 1 to retry.
+ */
+static int
+busy_handler (void *data,
+              int   count)
+{
+  DatabaseConnection *connection = data;
+  uint64_t backoff_us, sleep_us, start;
+  int shift = (count < 16) ? count : 16;
+
+  if (count == 0)
+    {
+      connection->busy_stats.busy_events++;
+      connection->busy_wait_us = 0;
+    }
+
+  // Exponential backoff, bounded by busy_max_backoff_ms; sleep a random
+  // time in [backoff/2, backoff], so contending processes don't retry in step
+  backoff_us = (uint64_t) connection->busy_initial_backoff_ms * 1000 << shift;
+  if (backoff_us > (uint64_t) connection->busy_max_backoff_ms * 1000)
+    backoff_us = (uint64_t) connection->busy_max_backoff_ms * 1000;
+  sleep_us = backoff_us / 2 + (uint64_t) rand_r (&connection->busy_seed) % (backoff_us / 2 + 1);
+
+  if (connection->busy_wait_us + sleep_us > (uint64_t) connection->busy_timeout_ms * 1000)
+    {
+      connection->busy_stats.timeouts++;
+      DEBUG_PRINT (("Database busy: giving up after %" PRIu64 " us", connection->busy_wait_us));
+      return 0;
+    }
+
+  start = monotonic_us ();
+  usleep ((useconds_t) sleep_us);
+  sleep_us = monotonic_us () - start;
+
+  connection->busy_wait_us += sleep_us;
+  connection->busy_stats.retries++;
+  connection->busy_stats.total_wait_us += sleep_us;
+  if (connection->busy_wait_us > connection->busy_stats.max_wait_us)
+    connection->busy_stats.max_wait_us = connection->busy_wait_us;
+
+  return 1;
+}
+
+static int
+apply_options (DatabaseConnection      *connection,
+               const ConnectionOptions *options)
+{
+  char pragma[PRAGMA_ALLOC];
+  int len = 0;
+  int rc;
+
+  if (options->journal_mode == JOURNAL_MODE_WAL && !connection->read_only)
+    len += snprintf (pragma + len, PRAGMA_ALLOC - len, "PRAGMA journal_mode = WAL;");
+  else if (options->journal_mode == JOURNAL_MODE_DELETE && !connection->read_only)
+    len += snprintf (pragma + len, PRAGMA_ALLOC - len, "PRAGMA journal_mode = DELETE;");
+
+  if (options->synchronous != SYNCHRONOUS_DEFAULT)
+    len += snprintf (pragma + len, PRAGMA_ALLOC - len,
+                     "PRAGMA synchronous = %d;", options->synchronous);
+
+  if (options->mmap_size > 0)
+    len += snprintf (pragma + len, PRAGMA_ALLOC - len,
+                     "PRAGMA mmap_size = %" PRId64 ";", options->mmap_size);
+
+  if (options->cache_size != 0)
+    len += snprintf (pragma + len, PRAGMA_ALLOC - len,
+                     "PRAGMA cache_size = %d;", options->cache_size);
+
+  if (options->temp_store != TEMP_STORE_DEFAULT)
+    len += snprintf (pragma + len, PRAGMA_ALLOC - len,
+                     "PRAGMA temp_store = %d;", options->temp_store);
+
+  if (options->query_only)
+    len += snprintf (pragma + len, PRAGMA_ALLOC - len, "PRAGMA query_only = 1;");
+
+  if (len == 0)
+    return SQLITE_OK;
+
+  DEBUG_PRINT (("Connection options:\n\t%s", pragma));
+
+  rc = sqlite3_exec (connection->db, pragma, NULL, NULL, NULL);
+  if (rc != SQLITE_OK)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "Failed to set connection options: %s\n",
+               sqlite3_errmsg (connection->db));
+    }
+
+  return rc;
+}
+
+DatabaseConnection *
+database_connection_open (bool read_only)
+{
+  ConnectionOptions options;
+
+  database_connection_options_init (&options, CONNECTION_PROFILE_DEFAULT);
+  options.read_only = read_only;
+
+  return database_connection_open_with_options (&options);
+}
+
+// Commits still in the WAL file, which an immutable handle wouldn't see
+static bool
+wal_pending (void)
+{
+  struct stat wal;
+
+  return stat (WAL_PATH, &wal) == 0 && wal.st_size > 0;
+}
+
+DatabaseConnection *
+database_connection_open_with_options (const ConnectionOptions *options)
 {
   int rc = 0;
+  int flags;
+  bool read_only = options->read_only || options->immutable;
+  DatabaseConnection *connection = NULL;
 
-  if (utils_get_pdb () != NULL)
+  if (!read_only && !utils_acquire_writer ())
     {
-      printf ("Warning: Database already connected.\n");
-      return SQLITE_OK;
+      fprintf (stderr, "ERROR: A writer connection is already open\n");
+      return NULL;
     }
 
-  // Open the SQLite database
-  if (!read_only)
-    rc = sqlite3_open_v2 (DB_PATH, utils_get_ppdb (), SQLITE_OPEN_READWRITE, NULL);
+  if (options->immutable && wal_pending ())
+    {
+      fprintf (stderr, "ERROR: The database has commits in its WAL file; it can't be opened as immutable\n");
+      return NULL;
+    }
+
+  connection = calloc (1, sizeof (DatabaseConnection));
+  if (connection == NULL)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to allocate memory\n");
+      if (!read_only)
+        utils_release_writer ();
+      return NULL;
+    }
+
+  connection->read_only = read_only;
+  connection->immutable = options->immutable;
+  connection->change_fd = connection->event_fd = connection->inotify_fd = -1;
+
+  // Open the SQLite database; each handle is used by one thread at a time,
+  // so SQLite's own mutex isn't needed
+  flags = SQLITE_OPEN_NOMUTEX;
+  flags |= read_only ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE;
+
+  if (options->immutable)
+    rc = sqlite3_open_v2 (IMMUTABLE_URI, &connection->db, flags | SQLITE_OPEN_URI, NULL);
   else
-    rc = sqlite3_open_v2 (DB_PATH, utils_get_ppdb (), SQLITE_OPEN_READONLY, NULL);
+    rc = sqlite3_open_v2 (DB_PATH, &connection->db, flags, NULL);
 
   if (rc != SQLITE_OK)
     {
       DEBUG_PRINT_CONTEX;
-      fprintf (stderr, "Can't open database: %s\n", sqlite3_errmsg (utils_get_pdb ()));
-      sqlite3_close (utils_get_pdb ());
-      return rc;
+      fprintf (stderr, "Can't open database: %s\n", sqlite3_errmsg (connection->db));
+      database_connection_close (&connection);
+      return NULL;
     }
-  else
+
+  // Enable security options
+  sqlite3_db_config (connection->db, SQLITE_DBCONFIG_DEFENSIVE, 0, 0);
+  sqlite3_db_config (connection->db, SQLITE_DBCONFIG_ENABLE_TRIGGER, 0, 0);
+  sqlite3_db_config (connection->db, SQLITE_DBCONFIG_ENABLE_VIEW, 0, 0);
+  sqlite3_db_config (connection->db, SQLITE_DBCONFIG_TRUSTED_SCHEMA, 0, 0);
+
+  notification_init (connection);
+  profile_init (connection);
+
+  // Busy policy
+  if (options->busy_timeout_ms > 0)
+    {
+      connection->busy_timeout_ms = options->busy_timeout_ms;
+
+      connection->busy_initial_backoff_ms = options->busy_initial_backoff_ms;
+      if (connection->busy_initial_backoff_ms <= 0)
+        connection->busy_initial_backoff_ms = 1;
+
+      connection->busy_max_backoff_ms = options->busy_max_backoff_ms;
+      if (connection->busy_max_backoff_ms < connection->busy_initial_backoff_ms)
+        connection->busy_max_backoff_ms = connection->busy_initial_backoff_ms;
+
+      connection->busy_seed = (unsigned int) (monotonic_us () ^ (uintptr_t) connection);
+      sqlite3_busy_handler (connection->db, busy_handler, connection);
+    }
+
+  if (apply_options (connection, options) != SQLITE_OK
+      || migration_run (connection) == EXIT_FAILURE)
     {
-      // Enable security options
-      sqlite3_db_config (utils_get_pdb (), SQLITE_DBCONFIG_DEFENSIVE, 0, 0);
-      sqlite3_db_config (utils_get_pdb (), SQLITE_DBCONFIG_ENABLE_TRIGGER, 0, 0);
-      sqlite3_db_config (utils_get_pdb (), SQLITE_DBCONFIG_ENABLE_VIEW, 0, 0);
-      sqlite3_db_config (utils_get_pdb (), SQLITE_DBCONFIG_TRUSTED_SCHEMA, 0, 0);
+      database_connection_close (&connection);
+      return NULL;
     }
 
-  return rc;
+  return connection;
+}
+
+void
+database_connection_close (DatabaseConnection **self)
+{
+  if (*self == NULL)
+    return;
+
+  // Cached statements must be finalized before closing
+  utils_finalize_statements (*self);
+  notification_finalize (*self);
+  rule_index_finalize (*self);
+  sqlite3_close ((*self)->db);
+
+  if (!(*self)->read_only)
+    utils_release_writer ();
+
+  free (*self);
+  *self = NULL;
+}
+
+int
+database_connection_get_busy_stats (DatabaseConnection *connection,
+                                    BusyStats          *stats)
+{
+  connection = utils_get_connection (connection);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Database not connected\n");
+      return EXIT_FAILURE;
+    }
+
+  *stats = connection->busy_stats;
+  return EXIT_SUCCESS;
+}
+
+void
+database_connection_reset_busy_stats (DatabaseConnection *connection)
+{
+  connection = utils_get_connection (connection);
+  if (connection != NULL)
+    connection->busy_stats = (BusyStats) { 0 };
+}
+
+void
+database_connection_invalidate_time_zone (DatabaseConnection *connection)
+{
+  connection = utils_get_connection (connection);
+  if (connection != NULL)
+    tz_offsets_invalidate (&connection->tz_offsets);
+}
+
+static int
+connect_database_with_options (const ConnectionOptions *options)
+{
+  DatabaseConnection **connection = utils_get_default_connection ();
+
+  if (*connection != NULL)
+    {
+      printf ("Warning: Database already connected.\n");
+      return SQLITE_OK;
+    }
+
+  *connection = database_connection_open_with_options (options);
+  if (*connection == NULL)
+    return SQLITE_ERROR;
+
+  return SQLITE_OK;
+}
+
+// This function connect to the database
+// Should be called once
+int
+connect_database (bool read_only)
+{
+  ConnectionOptions options;
+
+  database_connection_options_init (&options, CONNECTION_PROFILE_DEFAULT);
+  options.read_only = read_only;
+
+  return connect_database_with_options (&options);
+}
+
+int
+connect_database_with_profile (ConnectionProfile profile)
+{
+  ConnectionOptions options;
+
+  database_connection_options_init (&options, profile);
+
+  return connect_database_with_options (&options);
 }
 
 int
 disconnect_database (void)
 {
-  sqlite3 **db = utils_get_ppdb ();
-  int rc = sqlite3_close (utils_get_pdb ());
-  *db = NULL;
-  return rc;
+  database_connection_close (utils_get_default_connection ());
+  return SQLITE_OK;
 }
 
 bool
@@ -29,10 +29,104 @@
 #include "rule-validation.h"
 #include "time-converter.h"
 
+// Predefined sets of ConnectionOptions
+typedef enum
+{
+  CONNECTION_PROFILE_DEFAULT,             // SQLite defaults
+  CONNECTION_PROFILE_INTERACTIVE_WRITER,  // WAL, synchronous=NORMAL
+  CONNECTION_PROFILE_READ_ONLY_SCANNER,   // read-only, memory mapped, query_only
+  CONNECTION_PROFILE_BOOT_ONESHOT,        // read-only, query_only, never synced
+  CONNECTION_PROFILE_LAST
+} ConnectionProfile;
+
+typedef enum
+{
+  JOURNAL_MODE_DEFAULT,   // keep the mode stored in the database
+  JOURNAL_MODE_DELETE,
+  JOURNAL_MODE_WAL
+} JournalMode;
+
+// Same values as SQLite's PRAGMA synchronous
+typedef enum
+{
+  SYNCHRONOUS_DEFAULT = -1,
+  SYNCHRONOUS_OFF,
+  SYNCHRONOUS_NORMAL,
+  SYNCHRONOUS_FULL
+} Synchronous;
+
+// Same values as SQLite's PRAGMA temp_store
+typedef enum
+{
+  TEMP_STORE_DEFAULT,
+  TEMP_STORE_FILE,
+  TEMP_STORE_MEMORY
+} TempStore;
+
+typedef struct
+{
+  bool read_only;
+  bool query_only;            // refuse any change, even on a writable connection
+  // The file won't change while open: skip locking (implies read_only).
+  // SQLite then ignores the WAL file, so the open fails while it holds
+  // commits; an outdated schema can't be upgraded either
+  bool immutable;
+  JournalMode journal_mode;   // only applied on writable connections
+  Synchronous synchronous;
+  int64_t mmap_size;          // in bytes; 0 keeps SQLite's default
+  int cache_size;             // as PRAGMA cache_size (negative: KiB); 0 keeps SQLite's default
+  TempStore temp_store;
+
+  // Busy policy: while the database is locked by another connection, retry
+  // with exponential backoff (plus jitter) from busy_initial_backoff_ms up to
+  // busy_max_backoff_ms per sleep, giving up after busy_timeout_ms in total;
+  // busy_timeout_ms = 0 fails immediately with SQLITE_BUSY
+  int busy_timeout_ms;
+  int busy_initial_backoff_ms;
+  int busy_max_backoff_ms;
+} ConnectionOptions;
+
+typedef struct
+{
+  uint64_t busy_events;     // operations that found the database locked
+  uint64_t retries;         // sleeps before retrying
+  uint64_t timeouts;        // operations that gave up waiting
+  uint64_t total_wait_us;   // time spent sleeping, in microseconds
+  uint64_t max_wait_us;     // longest wait of a single operation, in microseconds
+} BusyStats;
+
+void database_connection_options_init (ConnectionOptions *options,
+                                       ConnectionProfile  profile);
+
+/*
+ * Connection handles: any number of read-only handles may be open at the
+ * same time, but only one writer. A handle owns its prepared statements, so
+ * it must be used by one thread at a time; give each thread its own handle.
+ *
+ * The functions of the rules and configuration APIs that end with "_full"
+ * take the handle to use; passing NULL uses the default connection, managed
+ * by connect_database() and disconnect_database().
+ */
+DatabaseConnection *database_connection_open (bool read_only);
+DatabaseConnection *database_connection_open_with_options (const ConnectionOptions *options);
+void database_connection_close (DatabaseConnection **self);
+
+// Pass NULL to use the default connection
+int database_connection_get_busy_stats (DatabaseConnection *connection,
+                                        BusyStats          *stats);
+void database_connection_reset_busy_stats (DatabaseConnection *connection);
+
+// Drops the cached time zone offsets; a change of TZ or of /etc/localtime
+// is already noticed, this is for anything else (e.g. new tzdata rules)
+void database_connection_invalidate_time_zone (DatabaseConnection *connection);
+
 int connect_database (bool read_only);
+int connect_database_with_profile (ConnectionProfile profile);
 int disconnect_database (void);
 bool check_user_group (void);
 
+# include "database-notification.h"
+# include "database-profile.h"
 # include "rules-reader.h"
 
 #ifdef ALLOW_MANAGING_RULES
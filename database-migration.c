@@ -0,0 +1,249 @@
+/* database-migration.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdlib.h>
+#include <sqlite3.h>
+
+#include "database-connection-utils.h"
+#include "database-migration.h"
+#include "debugger.h"
+
+#define UPGRADE_BUSY_TIMEOUT_MS 5000
+
+/*
+ * MIGRATIONS[n] upgrades the schema from version n to n + 1. SQLite can't
+ * change the type of a column, so tables are rebuilt: the new table is
+ * created, filled from the old one, which is then dropped.
+ */
+/*
+ * Rebuilt tables keep AUTOINCREMENT, and the new table takes over the
+ * sequence of the old one (if it had any): ids of deleted rules are never
+ * reused
+ */
+#define KEEP_SEQUENCE(table) \
+  "DELETE FROM sqlite_sequence WHERE name = '" table "_new';"\
+  "INSERT INTO sqlite_sequence (name, seq) SELECT '" table "_new', max("\
+  " coalesce((SELECT seq FROM sqlite_sequence WHERE name = '" table "'), 0),"\
+  " coalesce((SELECT max(id) FROM " table "_new), 0));"
+
+static const char *MIGRATIONS[SCHEMA_VERSION] =
+{
+  // 0 -> 1: 'HH:MM:SS' text to minute of the day
+  "CREATE TABLE rules_turnon_new ("\
+  " id INTEGER PRIMARY KEY AUTOINCREMENT,"\
+  " rule_name TEXT NOT NULL,"\
+  " rule_minute INTEGER NOT NULL CHECK (rule_minute BETWEEN 0 AND 1439),"\
+  " sun INTEGER NOT NULL, mon INTEGER NOT NULL, tue INTEGER NOT NULL, wed INTEGER NOT NULL,"\
+  " thu INTEGER NOT NULL, fri INTEGER NOT NULL, sat INTEGER NOT NULL,"\
+  " active INTEGER NOT NULL);"\
+  "INSERT INTO rules_turnon_new "\
+  " SELECT id, rule_name,"\
+  " CAST(strftime('%H', rule_time) AS INTEGER) * 60 + CAST(strftime('%M', rule_time) AS INTEGER),"\
+  " sun, mon, tue, wed, thu, fri, sat, active FROM rules_turnon;"\
+  KEEP_SEQUENCE ("rules_turnon")\
+  "DROP TABLE rules_turnon;"\
+  "ALTER TABLE rules_turnon_new RENAME TO rules_turnon;"\
+  "CREATE INDEX rules_turnon_minute ON rules_turnon (rule_minute);"\
+
+  "CREATE TABLE rules_turnoff_new ("\
+  " id INTEGER PRIMARY KEY AUTOINCREMENT,"\
+  " rule_name TEXT NOT NULL,"\
+  " rule_minute INTEGER NOT NULL CHECK (rule_minute BETWEEN 0 AND 1439),"\
+  " sun INTEGER NOT NULL, mon INTEGER NOT NULL, tue INTEGER NOT NULL, wed INTEGER NOT NULL,"\
+  " thu INTEGER NOT NULL, fri INTEGER NOT NULL, sat INTEGER NOT NULL,"\
+  " active INTEGER NOT NULL,"\
+  " mode INTEGER NOT NULL);"\
+  "INSERT INTO rules_turnoff_new "\
+  " SELECT id, rule_name,"\
+  " CAST(strftime('%H', rule_time) AS INTEGER) * 60 + CAST(strftime('%M', rule_time) AS INTEGER),"\
+  " sun, mon, tue, wed, thu, fri, sat, active, mode FROM rules_turnoff;"\
+  KEEP_SEQUENCE ("rules_turnoff")\
+  "DROP TABLE rules_turnoff;"\
+  "ALTER TABLE rules_turnoff_new RENAME TO rules_turnoff;"\
+  "CREATE INDEX rules_turnoff_minute ON rules_turnoff (rule_minute);",
+
+  // 1 -> 2: sun..sat columns to a week days mask, bit 0 being Sunday
+  "CREATE TABLE rules_turnon_new ("\
+  " id INTEGER PRIMARY KEY AUTOINCREMENT,"\
+  " rule_name TEXT NOT NULL,"\
+  " rule_minute INTEGER NOT NULL CHECK (rule_minute BETWEEN 0 AND 1439),"\
+  " days INTEGER NOT NULL CHECK (days BETWEEN 0 AND 127),"\
+  " active INTEGER NOT NULL);"\
+  "INSERT INTO rules_turnon_new "\
+  " SELECT id, rule_name, rule_minute,"\
+  " (sun != 0) | ((mon != 0) << 1) | ((tue != 0) << 2) | ((wed != 0) << 3)"\
+  " | ((thu != 0) << 4) | ((fri != 0) << 5) | ((sat != 0) << 6),"\
+  " active FROM rules_turnon;"\
+  KEEP_SEQUENCE ("rules_turnon")\
+  "DROP TABLE rules_turnon;"\
+  "ALTER TABLE rules_turnon_new RENAME TO rules_turnon;"\
+  "CREATE INDEX rules_turnon_minute ON rules_turnon (rule_minute);"\
+
+  "CREATE TABLE rules_turnoff_new ("\
+  " id INTEGER PRIMARY KEY AUTOINCREMENT,"\
+  " rule_name TEXT NOT NULL,"\
+  " rule_minute INTEGER NOT NULL CHECK (rule_minute BETWEEN 0 AND 1439),"\
+  " days INTEGER NOT NULL CHECK (days BETWEEN 0 AND 127),"\
+  " active INTEGER NOT NULL,"\
+  " mode INTEGER NOT NULL);"\
+  "INSERT INTO rules_turnoff_new "\
+  " SELECT id, rule_name, rule_minute,"\
+  " (sun != 0) | ((mon != 0) << 1) | ((tue != 0) << 2) | ((wed != 0) << 3)"\
+  " | ((thu != 0) << 4) | ((fri != 0) << 5) | ((sat != 0) << 6),"\
+  " active, mode FROM rules_turnoff;"\
+  KEEP_SEQUENCE ("rules_turnoff")\
+  "DROP TABLE rules_turnoff;"\
+  "ALTER TABLE rules_turnoff_new RENAME TO rules_turnoff;"\
+  "CREATE INDEX rules_turnoff_minute ON rules_turnoff (rule_minute);",
+
+  // 2 -> 3: rule queries by time or name are answered from the index alone
+  "DROP INDEX rules_turnon_minute;"\
+  "CREATE INDEX rules_turnon_time ON rules_turnon (rule_minute, id, active, days, rule_name);"\
+  "CREATE INDEX rules_turnon_name ON rules_turnon (rule_name, rule_minute, active, days);"\
+  "DROP INDEX rules_turnoff_minute;"\
+  "CREATE INDEX rules_turnoff_time ON rules_turnoff (rule_minute, id, active, days, rule_name, mode);"\
+  "CREATE INDEX rules_turnoff_name ON rules_turnoff (rule_name, rule_minute, active, days, mode);",
+};
+
+static int
+get_schema_version (sqlite3 *db,
+                    int     *version)
+{
+  sqlite3_stmt *stmt = NULL;
+  int rc;
+
+  // Run once per connection, so it isn't cached
+  rc = sqlite3_prepare_v2 (db, "PRAGMA user_version;", -1, &stmt, NULL);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_step (stmt);
+
+  if (rc != SQLITE_ROW)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR (failed to query the schema version): %s\n", sqlite3_errmsg (db));
+      sqlite3_finalize (stmt);
+      return EXIT_FAILURE;
+    }
+
+  *version = sqlite3_column_int (stmt, 0);
+  sqlite3_finalize (stmt);
+
+  return EXIT_SUCCESS;
+}
+
+// Runs the migrations on a writable handle
+static int
+upgrade (sqlite3 *db)
+{
+  char pragma[48];
+  int version;
+
+  // Check again while holding the write lock: another process may have
+  // migrated the database in the meantime
+  if (sqlite3_exec (db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK
+      || get_schema_version (db, &version) == EXIT_FAILURE)
+    goto error;
+
+  for (; version < SCHEMA_VERSION; version++)
+    {
+      printf ("Info: Upgrading database schema to version %d\n", version + 1);
+
+      snprintf (pragma, sizeof (pragma), "PRAGMA user_version = %d;", version + 1);
+
+      if (sqlite3_exec (db, MIGRATIONS[version], NULL, NULL, NULL) != SQLITE_OK
+          || sqlite3_exec (db, pragma, NULL, NULL, NULL) != SQLITE_OK)
+        goto error;
+    }
+
+  if (sqlite3_exec (db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+    goto error;
+
+  return EXIT_SUCCESS;
+
+error:
+  DEBUG_PRINT_CONTEX;
+  fprintf (stderr, "ERROR (failed to upgrade the database schema): %s\n", sqlite3_errmsg (db));
+  if (!sqlite3_get_autocommit (db))
+    sqlite3_exec (db, "ROLLBACK;", NULL, NULL, NULL);
+  return EXIT_FAILURE;
+}
+
+/*
+ * Read-only connections get the file upgraded by a short-lived writable
+ * one, which counts as the writer of the process while it's open
+ */
+static int
+upgrade_file (void)
+{
+  sqlite3 *db = NULL;
+  int ret = EXIT_FAILURE;
+
+  DEBUG_PRINT (("Upgrading the database schema for a read-only connection"));
+
+  if (!utils_acquire_writer ())
+    {
+      fprintf (stderr, "ERROR: Database schema is outdated and can't be upgraded while a writer connection is open\n");
+      return EXIT_FAILURE;
+    }
+
+  if (sqlite3_open_v2 (DB_PATH, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Database schema is outdated and can't be upgraded: %s\n",
+               sqlite3_errmsg (db));
+    }
+  else
+    {
+      sqlite3_busy_timeout (db, UPGRADE_BUSY_TIMEOUT_MS);
+      ret = upgrade (db);
+    }
+
+  sqlite3_close (db);
+  utils_release_writer ();
+  return ret;
+}
+
+int
+migration_run (DatabaseConnection *connection)
+{
+  int version;
+
+  if (get_schema_version (connection->db, &version) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  if (version == SCHEMA_VERSION)
+    return EXIT_SUCCESS;
+
+  if (version > SCHEMA_VERSION)
+    {
+      fprintf (stderr, "ERROR: Database schema version %d is newer than supported (%d)\n",
+               version, SCHEMA_VERSION);
+      return EXIT_FAILURE;
+    }
+
+  if (connection->immutable)
+    {
+      fprintf (stderr, "ERROR: Database schema version %d is outdated; "
+               "open it without \"immutable\" to upgrade it\n", version);
+      return EXIT_FAILURE;
+    }
+
+  return connection->read_only ? upgrade_file () : upgrade (connection->db);
+}
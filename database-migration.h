@@ -0,0 +1,43 @@
+/* database-migration.h
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef DATABASE_MIGRATION_H_
+#define DATABASE_MIGRATION_H_
+
+#include "gawake-types.h"
+
+/*
+ * Schema version, stored as PRAGMA user_version:
+ *  0: legacy schema (rule_time as 'HH:MM:SS' text)
+ *  1: rule time as an integer minute of the day (rule_minute)
+ *  2: week days packed in a single mask column (days)
+ *  3: covering indexes for the rule queries
+ */
+#define SCHEMA_VERSION 3
+
+/*
+ * Brings the schema up to SCHEMA_VERSION. Read-only connections can't
+ * migrate themselves, so the file is upgraded through a short-lived
+ * writable connection; immutable ones fail, as SQLite was told the file
+ * won't change.
+ */
+int migration_run (DatabaseConnection *connection);
+
+#endif /* DATABASE_MIGRATION_H_ */
@@ -0,0 +1,242 @@
+/* database-notification.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Changes made through a connection are tracked with SQLite's update, commit
+ * and rollback hooks, and signaled on an eventfd. Changes made by any other
+ * connection (of this or another process) touch the database (or WAL) file:
+ * an inotify watch on the database directory wakes the caller up, and
+ * PRAGMA data_version tells if the database really changed. Both
+ * descriptors are grouped in an epoll instance, so callers poll a single
+ * file descriptor.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "database-connection-utils.h"
+#include "database-notification.h"
+#include "debugger.h"
+
+#define INOTIFY_BUFFER_ALLOC 4096
+
+static unsigned int
+table_change (const char *table)
+{
+  if (strcmp (table, TABLE[TABLE_ON]) == 0)
+    return DATABASE_CHANGE_RULES_TURNON;
+  else if (strcmp (table, TABLE[TABLE_OFF]) == 0)
+    return DATABASE_CHANGE_RULES_TURNOFF;
+  else if (strcmp (table, "config") == 0)
+    return DATABASE_CHANGE_CONFIG;
+  else if (strcmp (table, "custom_schedule") == 0)
+    return DATABASE_CHANGE_CUSTOM_SCHEDULE;
+  else
+    return DATABASE_CHANGE_NONE;
+}
+
+// Called for each changed row, before the transaction is committed
+static void
+update_hook (void          *data,
+             int            operation,
+             const char    *database,
+             const char    *table,
+             sqlite3_int64  rowid)
+{
+  DatabaseConnection *connection = data;
+  unsigned int change = table_change (table);
+
+  (void) operation;
+  (void) database;
+  (void) rowid;
+
+  // Invalidates the config snapshot right away, even before the commit
+  if (change == DATABASE_CHANGE_CONFIG)
+    connection->config_writes++;
+
+  connection->uncommitted_changes |= change;
+}
+
+// Must not use the connection: only record and signal the changes
+static int
+commit_hook (void *data)
+{
+  DatabaseConnection *connection = data;
+
+  connection->pending_changes |= connection->uncommitted_changes;
+  connection->uncommitted_changes = DATABASE_CHANGE_NONE;
+
+  if (connection->pending_changes != DATABASE_CHANGE_NONE && connection->event_fd >= 0)
+    eventfd_write (connection->event_fd, 1);
+
+  // Returning non-zero would turn the commit into a rollback
+  return 0;
+}
+
+static void
+rollback_hook (void *data)
+{
+  DatabaseConnection *connection = data;
+
+  // A snapshot read inside the transaction has the discarded values
+  if (connection->uncommitted_changes & DATABASE_CHANGE_CONFIG)
+    connection->config_writes++;
+
+  connection->uncommitted_changes = DATABASE_CHANGE_NONE;
+}
+
+void
+notification_init (DatabaseConnection *connection)
+{
+  // Only writable connections can make changes
+  if (connection->read_only)
+    return;
+
+  sqlite3_update_hook (connection->db, update_hook, connection);
+  sqlite3_commit_hook (connection->db, commit_hook, connection);
+  sqlite3_rollback_hook (connection->db, rollback_hook, connection);
+}
+
+void
+notification_finalize (DatabaseConnection *connection)
+{
+  if (connection->change_fd >= 0)
+    close (connection->change_fd);
+  if (connection->event_fd >= 0)
+    close (connection->event_fd);
+  if (connection->inotify_fd >= 0)
+    close (connection->inotify_fd);
+
+  connection->change_fd = connection->event_fd = connection->inotify_fd = -1;
+}
+
+int
+database_connection_get_change_fd (DatabaseConnection *connection)
+{
+  struct epoll_event event = { .events = EPOLLIN };
+
+  connection = utils_get_connection (connection);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Database not connected\n");
+      return -1;
+    }
+
+  if (connection->change_fd >= 0)
+    return connection->change_fd;
+
+  // Changes are reported relative to this moment
+  if (!connection->data_version_known
+      && utils_get_data_version (connection, &connection->data_version) == EXIT_SUCCESS)
+    connection->data_version_known = true;
+
+  connection->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  connection->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  connection->change_fd = epoll_create1 (EPOLL_CLOEXEC);
+
+  if (connection->event_fd < 0 || connection->inotify_fd < 0 || connection->change_fd < 0
+      // The directory is watched, as the WAL file may be created later
+      || inotify_add_watch (connection->inotify_fd, DB_DIR,
+                            IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    goto error;
+
+  event.data.fd = connection->event_fd;
+  if (epoll_ctl (connection->change_fd, EPOLL_CTL_ADD, connection->event_fd, &event) < 0)
+    goto error;
+
+  event.data.fd = connection->inotify_fd;
+  if (epoll_ctl (connection->change_fd, EPOLL_CTL_ADD, connection->inotify_fd, &event) < 0)
+    goto error;
+
+  // Changes committed before the descriptor existed
+  if (connection->pending_changes != DATABASE_CHANGE_NONE)
+    eventfd_write (connection->event_fd, 1);
+
+  return connection->change_fd;
+
+error:
+  DEBUG_PRINT_CONTEX;
+  fprintf (stderr, "ERROR: Failed to watch the database for changes\n");
+  notification_finalize (connection);
+  return -1;
+}
+
+void
+database_connection_set_change_callback (DatabaseConnection *connection,
+                                         DatabaseChangeFunc  func,
+                                         void               *user_data)
+{
+  connection = utils_get_connection (connection);
+  if (connection == NULL)
+    return;
+
+  connection->change_func = func;
+  connection->change_data = user_data;
+}
+
+int
+database_connection_dispatch_changes (DatabaseConnection *connection,
+                                      unsigned int       *changes)
+{
+  int64_t data_version;
+  eventfd_t value;
+  char buffer[INOTIFY_BUFFER_ALLOC];
+
+  *changes = DATABASE_CHANGE_NONE;
+
+  connection = utils_get_connection (connection);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Database not connected\n");
+      return EXIT_FAILURE;
+    }
+
+  // Drain the descriptors, so the change_fd isn't readable anymore
+  if (connection->event_fd >= 0)
+    eventfd_read (connection->event_fd, &value);
+  if (connection->inotify_fd >= 0)
+    while (read (connection->inotify_fd, buffer, INOTIFY_BUFFER_ALLOC) > 0);
+
+  // Changes made through this connection
+  *changes = connection->pending_changes;
+  connection->pending_changes = DATABASE_CHANGE_NONE;
+
+  // Changes made by other connections: data_version doesn't change with
+  // commits of the connection itself
+  if (utils_get_data_version (connection, &data_version) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  if (connection->data_version_known && data_version != connection->data_version)
+    *changes |= DATABASE_CHANGE_ALL | DATABASE_CHANGE_EXTERNAL;
+
+  connection->data_version = data_version;
+  connection->data_version_known = true;
+
+  DEBUG_PRINT (("Database changes: 0x%x", *changes));
+
+  if (*changes != DATABASE_CHANGE_NONE && connection->change_func != NULL)
+    connection->change_func (connection, *changes, connection->change_data);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,68 @@
+/* database-notification.h
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef DATABASE_NOTIFICATION_H_
+#define DATABASE_NOTIFICATION_H_
+
+#include "gawake-types.h"
+
+// Bit mask of changed tables
+typedef enum
+{
+  DATABASE_CHANGE_NONE            = 0,
+  DATABASE_CHANGE_RULES_TURNON    = 1 << TABLE_ON,
+  DATABASE_CHANGE_RULES_TURNOFF   = 1 << TABLE_OFF,
+  DATABASE_CHANGE_CONFIG          = 1 << 2,
+  DATABASE_CHANGE_CUSTOM_SCHEDULE = 1 << 3,
+  DATABASE_CHANGE_ALL             = (1 << 4) - 1,
+
+  // Set along with DATABASE_CHANGE_ALL when the change was made by another
+  // connection, in which case the changed tables are unknown
+  DATABASE_CHANGE_EXTERNAL        = 1 << 4
+} DatabaseChange;
+
+typedef void (*DatabaseChangeFunc) (DatabaseConnection *connection,
+                                    unsigned int        changes,
+                                    void               *user_data);
+
+/*
+ * Returns a file descriptor that becomes readable (poll/select/epoll) when
+ * the database may have changed, either through this connection or any
+ * other one, from this or another process. When it's readable, call
+ * database_connection_dispatch_changes(). The descriptor is owned by the
+ * connection. Returns -1 on failure.
+ */
+int database_connection_get_change_fd (DatabaseConnection *connection);
+
+// The callback is called by database_connection_dispatch_changes()
+void database_connection_set_change_callback (DatabaseConnection *connection,
+                                              DatabaseChangeFunc  func,
+                                              void               *user_data);
+
+/*
+ * Reports the changes since the last call: sets "changes" to a DatabaseChange
+ * mask (DATABASE_CHANGE_NONE if nothing changed) and calls the callback, if
+ * any and there are changes. Can also be called without the file descriptor,
+ * to check for changes on demand.
+ */
+int database_connection_dispatch_changes (DatabaseConnection *connection,
+                                          unsigned int       *changes);
+
+#endif /* DATABASE_NOTIFICATION_H_ */
@@ -0,0 +1,331 @@
+/* database-profile.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * The histograms are process-wide arrays of atomic counters, updated with
+ * relaxed atomics from the trace callback of each connection: recording
+ * takes no lock. SQLite's own SQLITE_TRACE_PROFILE estimate has the
+ * resolution of the VFS clock (milliseconds, usually), so statements are
+ * timed with CLOCK_MONOTONIC from SQLITE_TRACE_STMT (first step) to
+ * SQLITE_TRACE_PROFILE (done or reset) instead. Each connection
+ * (re)registers its trace callback when it notices the enabled flag
+ * changed, at the start of an operation.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "database-connection-utils.h"
+#include "database-profile.h"
+#include "debugger.h"
+
+#define FIRST_BUCKET_BITS 10    // bucket 0 ends at 1 << FIRST_BUCKET_BITS ns
+#define SUB_BUCKETS_BITS 2      // each power of two is split in 1 << SUB_BUCKETS_BITS
+
+static const char *OPERATION_NAMES[PROFILE_OPERATION_LAST] =
+{
+  [PROFILE_OPERATION_OTHER]                   = "other",
+  [PROFILE_OPERATION_RULE_GET_SINGLE]         = "rule_get_single",
+  [PROFILE_OPERATION_RULE_GET_ALL]            = "rule_get_all",
+  [PROFILE_OPERATION_RULE_FOREACH]            = "rule_foreach",
+  [PROFILE_OPERATION_RULE_QUERY]              = "rule_query",
+  [PROFILE_OPERATION_RULE_GET_UPCOMING_ON]    = "rule_get_upcoming_on",
+  [PROFILE_OPERATION_RULE_GET_UPCOMING_OFF]   = "rule_get_upcoming_off",
+  [PROFILE_OPERATION_RULE_GET_UPCOMING_EVENTS] = "rule_get_upcoming_events",
+  [PROFILE_OPERATION_RULE_VALIDATE]           = "rule_validate",
+  [PROFILE_OPERATION_RULE_ADD]                = "rule_add",
+  [PROFILE_OPERATION_RULE_EDIT]               = "rule_edit",
+  [PROFILE_OPERATION_RULE_DELETE]             = "rule_delete",
+  [PROFILE_OPERATION_RULE_ENABLE_DISABLE]     = "rule_enable_disable",
+  [PROFILE_OPERATION_RULE_CUSTOM_SCHEDULE]    = "rule_custom_schedule",
+  [PROFILE_OPERATION_RULE_BATCH_COMMIT]       = "rule_batch_commit",
+  [PROFILE_OPERATION_CONFIG_GET]              = "get_config",
+  [PROFILE_OPERATION_CONFIG_SET]              = "set_config",
+};
+
+typedef struct
+{
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t total_ns;
+  atomic_uint_fast64_t max_ns;
+  atomic_uint_fast64_t buckets[PROFILE_BUCKETS];
+} AtomicHistogram;
+
+static AtomicHistogram histograms[PROFILE_OPERATION_LAST];
+static atomic_bool enabled = false;
+static atomic_flag environment_checked = ATOMIC_FLAG_INIT;
+
+static int
+bucket_of (uint64_t ns)
+{
+  int msb, bucket;
+
+  if (ns < (1u << FIRST_BUCKET_BITS))
+    return 0;
+
+  msb = 63 - __builtin_clzll (ns);
+  bucket = 1 + ((msb - FIRST_BUCKET_BITS) << SUB_BUCKETS_BITS)
+           + (int) ((ns >> (msb - SUB_BUCKETS_BITS)) & ((1u << SUB_BUCKETS_BITS) - 1));
+
+  return (bucket < PROFILE_BUCKETS) ? bucket : PROFILE_BUCKETS - 1;
+}
+
+uint64_t
+profile_bucket_upper_bound (int bucket)
+{
+  int octave, sub;
+
+  if (bucket <= 0)
+    return 1u << FIRST_BUCKET_BITS;
+  if (bucket >= PROFILE_BUCKETS - 1)
+    return UINT64_MAX;
+
+  octave = (bucket - 1) >> SUB_BUCKETS_BITS;
+  sub = (bucket - 1) & ((1 << SUB_BUCKETS_BITS) - 1);
+
+  return (uint64_t) ((1 << SUB_BUCKETS_BITS) + sub + 1)
+         << (octave + FIRST_BUCKET_BITS - SUB_BUCKETS_BITS);
+}
+
+static void
+record (ProfileOperation operation,
+        uint64_t         ns)
+{
+  AtomicHistogram *histogram = &histograms[operation];
+  uint_fast64_t max = atomic_load_explicit (&histogram->max_ns, memory_order_relaxed);
+
+  atomic_fetch_add_explicit (&histogram->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&histogram->total_ns, ns, memory_order_relaxed);
+  atomic_fetch_add_explicit (&histogram->buckets[bucket_of (ns)], 1, memory_order_relaxed);
+
+  while (ns > max
+         && !atomic_compare_exchange_weak_explicit (&histogram->max_ns, &max, ns,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+}
+
+static uint64_t
+monotonic_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static ProfileRunning *
+find_running (DatabaseConnection *connection,
+              sqlite3_stmt       *stmt)
+{
+  for (int i = 0; i < PROFILE_RUNNING_MAX; i++)
+    {
+      if (connection->profile_running[i].stmt == stmt)
+        return &connection->profile_running[i];
+    }
+
+  return NULL;
+}
+
+static int
+trace_callback (unsigned int  type,
+                void         *data,
+                void         *statement,
+                void         *argument)
+{
+  DatabaseConnection *connection = data;
+  ProfileRunning *running;
+  uint64_t ns;
+
+  if (type == SQLITE_TRACE_STMT)
+    {
+      // Also called for each trigger program, which are part of the statement
+      if (find_running (connection, statement) == NULL
+          && (running = find_running (connection, NULL)) != NULL)
+        *running = (ProfileRunning) { .stmt = statement, .start_ns = monotonic_ns () };
+      return 0;
+    }
+
+  if (type != SQLITE_TRACE_PROFILE)
+    return 0;
+
+  // SQLite's estimate, if the start wasn't recorded
+  running = find_running (connection, statement);
+  if (running != NULL)
+    {
+      ns = monotonic_ns () - running->start_ns;
+      running->stmt = NULL;
+    }
+  else
+    ns = (uint64_t) *(sqlite3_int64 *) argument;
+
+  if (atomic_load_explicit (&enabled, memory_order_relaxed))
+    record (connection->profile_operation, ns);
+
+  return 0;
+}
+
+// Registers or removes the trace callback to follow the enabled flag
+static void
+sync_trace (DatabaseConnection *connection)
+{
+  bool enable = atomic_load_explicit (&enabled, memory_order_relaxed);
+
+  if (connection->profile_traced == enable)
+    return;
+
+  if (enable)
+    sqlite3_trace_v2 (connection->db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE,
+                      trace_callback, connection);
+  else
+    sqlite3_trace_v2 (connection->db, 0, NULL, NULL);
+
+  for (int i = 0; i < PROFILE_RUNNING_MAX; i++)
+    connection->profile_running[i].stmt = NULL;
+
+  connection->profile_traced = enable;
+}
+
+void
+profile_init (DatabaseConnection *connection)
+{
+  if (!atomic_flag_test_and_set (&environment_checked) && getenv ("GAWAKE_PROFILE") != NULL)
+    database_profile_enable (true);
+
+  connection->profile_operation = PROFILE_OPERATION_OTHER;
+  sync_trace (connection);
+}
+
+ProfileOperation
+profile_begin (DatabaseConnection *connection,
+               ProfileOperation    operation)
+{
+  ProfileOperation previous;
+
+  connection = utils_get_connection (connection);
+  if (connection == NULL)
+    return PROFILE_OPERATION_OTHER;
+
+  sync_trace (connection);
+
+  previous = connection->profile_operation;
+  if (previous == PROFILE_OPERATION_OTHER)
+    connection->profile_operation = operation;
+
+  return previous;
+}
+
+void
+profile_end (DatabaseConnection *connection,
+             ProfileOperation    previous)
+{
+  connection = utils_get_connection (connection);
+  if (connection != NULL)
+    connection->profile_operation = previous;
+}
+
+void
+database_profile_enable (bool enable)
+{
+  DEBUG_PRINT (("Profiling %s", enable ? "enabled" : "disabled"));
+  atomic_store (&enabled, enable);
+}
+
+bool
+database_profile_is_enabled (void)
+{
+  return atomic_load (&enabled);
+}
+
+void
+database_profile_snapshot (ProfileOperation  operation,
+                           ProfileHistogram *histogram)
+{
+  const AtomicHistogram *source;
+
+  *histogram = (ProfileHistogram) { 0 };
+  if (operation < 0 || operation >= PROFILE_OPERATION_LAST)
+    return;
+
+  source = &histograms[operation];
+  histogram->count = atomic_load_explicit (&source->count, memory_order_relaxed);
+  histogram->total_ns = atomic_load_explicit (&source->total_ns, memory_order_relaxed);
+  histogram->max_ns = atomic_load_explicit (&source->max_ns, memory_order_relaxed);
+  for (int i = 0; i < PROFILE_BUCKETS; i++)
+    histogram->buckets[i] = atomic_load_explicit (&source->buckets[i], memory_order_relaxed);
+}
+
+void
+database_profile_reset (void)
+{
+  for (int op = 0; op < PROFILE_OPERATION_LAST; op++)
+    {
+      AtomicHistogram *histogram = &histograms[op];
+
+      atomic_store_explicit (&histogram->count, 0, memory_order_relaxed);
+      atomic_store_explicit (&histogram->total_ns, 0, memory_order_relaxed);
+      atomic_store_explicit (&histogram->max_ns, 0, memory_order_relaxed);
+      for (int i = 0; i < PROFILE_BUCKETS; i++)
+        atomic_store_explicit (&histogram->buckets[i], 0, memory_order_relaxed);
+    }
+}
+
+const char *
+database_profile_operation_name (ProfileOperation operation)
+{
+  if (operation < 0 || operation >= PROFILE_OPERATION_LAST)
+    return NULL;
+
+  return OPERATION_NAMES[operation];
+}
+
+uint64_t
+profile_histogram_percentile (const ProfileHistogram *histogram,
+                              double                  percentile)
+{
+  uint64_t total = 0, rank, bound;
+
+  for (int i = 0; i < PROFILE_BUCKETS; i++)
+    total += histogram->buckets[i];
+  if (total == 0)
+    return 0;
+
+  if (percentile < 0)
+    percentile = 0;
+  if (percentile > 100)
+    percentile = 100;
+
+  // Rank (1-based) of the statement at the percentile
+  rank = (uint64_t) (percentile / 100 * (double) total + 0.999999);
+  if (rank == 0)
+    rank = 1;
+
+  for (int i = 0; i < PROFILE_BUCKETS; i++)
+    {
+      if (histogram->buckets[i] >= rank)
+        {
+          // No statement took longer than max_ns
+          bound = profile_bucket_upper_bound (i);
+          return (histogram->max_ns > 0 && bound > histogram->max_ns) ? histogram->max_ns : bound;
+        }
+      rank -= histogram->buckets[i];
+    }
+
+  return histogram->max_ns;
+}
@@ -0,0 +1,92 @@
+/* database-profile.h
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef DATABASE_PROFILE_H_
+#define DATABASE_PROFILE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Logical operations the SQL statements are accounted to
+typedef enum
+{
+  PROFILE_OPERATION_OTHER,        // outside any operation below (e.g. migrations)
+  PROFILE_OPERATION_RULE_GET_SINGLE,
+  PROFILE_OPERATION_RULE_GET_ALL,
+  PROFILE_OPERATION_RULE_FOREACH,
+  PROFILE_OPERATION_RULE_QUERY,
+  PROFILE_OPERATION_RULE_GET_UPCOMING_ON,
+  PROFILE_OPERATION_RULE_GET_UPCOMING_OFF,
+  PROFILE_OPERATION_RULE_GET_UPCOMING_EVENTS,
+  PROFILE_OPERATION_RULE_VALIDATE,
+  PROFILE_OPERATION_RULE_ADD,
+  PROFILE_OPERATION_RULE_EDIT,
+  PROFILE_OPERATION_RULE_DELETE,
+  PROFILE_OPERATION_RULE_ENABLE_DISABLE,
+  PROFILE_OPERATION_RULE_CUSTOM_SCHEDULE,
+  PROFILE_OPERATION_RULE_BATCH_COMMIT,
+  PROFILE_OPERATION_CONFIG_GET,
+  PROFILE_OPERATION_CONFIG_SET,
+  PROFILE_OPERATION_LAST
+} ProfileOperation;
+
+/*
+ * Buckets of statement durations: bucket 0 is [0, 1024 ns); then each
+ * power of two from 1024 ns is split in 4 buckets, up to 2^36 ns (~69 s);
+ * the last bucket also counts anything longer
+ */
+#define PROFILE_BUCKETS (1 + 26 * 4)
+
+typedef struct
+{
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[PROFILE_BUCKETS];
+} ProfileHistogram;
+
+/*
+ * Records the duration of every SQL statement in the histogram of the
+ * operation that ran it; an operation called by another one is accounted
+ * to the outer one. A statement is timed from its first step to its end or
+ * reset, so whatever the caller does between steps counts too: the
+ * RULE_FOREACH histogram includes the time spent in the callback. Disabled
+ * by default, as SQLite then reads the clock twice per statement; setting
+ * the GAWAKE_PROFILE environment variable enables it on the first
+ * connection open. The histograms are shared by all connections.
+ */
+void database_profile_enable (bool enable);
+bool database_profile_is_enabled (void);
+
+// Copies of the counters, each read atomically (not all at the same instant)
+void database_profile_snapshot (ProfileOperation  operation,
+                                ProfileHistogram *histogram);
+void database_profile_reset (void);
+
+const char *database_profile_operation_name (ProfileOperation operation);
+
+// Upper bound of a bucket, in nanoseconds
+uint64_t profile_bucket_upper_bound (int bucket);
+// Duration (ns) under which "percentile" (0-100) of the statements ran,
+// rounded up to the bucket bound; 0 if the histogram is empty
+uint64_t profile_histogram_percentile (const ProfileHistogram *histogram,
+                                       double                  percentile);
+
+#endif /* DATABASE_PROFILE_H_ */
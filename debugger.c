@@ -27,10 +27,10 @@
 
 const char *print_timestamp (void)
 {
-  static struct tm * timeinfo;
-  static char timestamp[TIMESTAMP_ALLOC];
-  get_time_tm (&timeinfo);
-  strftime (timestamp, TIMESTAMP_ALLOC, "%Y/%m/%d %H:%M:%S", timeinfo);
+  struct tm timeinfo;
+  static _Thread_local char timestamp[TIMESTAMP_ALLOC];
+  get_time_tm_r (&timeinfo);
+  strftime (timestamp, TIMESTAMP_ALLOC, "%Y/%m/%d %H:%M:%S", &timeinfo);
 
   return timestamp;
 }
@@ -42,3 +42,41 @@ const char *MODE[] = {
 };
 
 const char *DAYS[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+
+bool
+rule_get_day (const Rule *rule,
+              const int   day)
+{
+  return (rule->days & DAY_BIT (day)) != 0;
+}
+
+void
+rule_set_day (Rule       *rule,
+              const int   day,
+              const bool  value)
+{
+  if (value)
+    rule->days |= DAY_BIT (day);
+  else
+    rule->days &= (uint8_t) ~DAY_BIT (day);
+}
+
+uint8_t
+rule_days_from_array (const bool days[7])
+{
+  uint8_t mask = 0;
+
+  for (int i = 0; i < 7; i++)
+    if (days[i])
+      mask |= DAY_BIT (i);
+
+  return mask;
+}
+
+void
+rule_days_to_array (const uint8_t mask,
+                    bool          days[7])
+{
+  for (int i = 0; i < 7; i++)
+    days[i] = (mask & DAY_BIT (i)) != 0;
+}
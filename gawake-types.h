@@ -7,11 +7,18 @@
 #define VERSION "3.1.0"
 
 #define DB_NAME "gawake.db"
-#define DB_DIR "/var/lib/gawake/"
+// Overridable at build time (e.g. the tests use a directory of their own)
+#ifndef DB_DIR
+# define DB_DIR "/var/lib/gawake/"
+#endif
 #define DB_PATH DB_DIR DB_NAME
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <time.h>
+
+// Opaque database connection handle; see database-connection.h
+typedef struct _DatabaseConnection DatabaseConnection;
 
 // ATTENTION: enum and char[] must be synced
 typedef enum
@@ -46,6 +53,10 @@ extern const char *MODE[];
 
 extern const char *DAYS[];
 
+// Week days as a mask: bit 0 is Sunday, ..., bit 6 is Saturday
+#define DAY_BIT(day) ((uint8_t) (1u << (day)))
+#define DAYS_ALL 0x7F
+
 typedef enum
 {
   NOTIFICATION_TIME_00 = 00,  /* no notification */
@@ -63,7 +74,7 @@ typedef struct
   char name[RULE_NAME_LENGTH];    // s
   uint8_t hour;                   // y
   uint8_t minutes;                // y
-  bool days[7];                   // ab
+  uint8_t days;                   // y (mask, see DAY_BIT)
   bool active;                    // b
   Mode mode;                      // y
   Table table;                    // y
@@ -80,6 +91,7 @@ typedef struct
   int month;
   int year;
   Mode mode;
+  time_t epoch;         // The instant it fires; the fields above may be in UTC, see use_localtime
 } RtcwakeArgs;
 
 typedef enum
@@ -92,4 +104,10 @@ typedef enum
 
 #define RtcwakeArgs_s sizeof (RtcwakeArgs)
 
+// Compatibility accessors for the former "bool days[7]" layout
+bool rule_get_day (const Rule *rule, const int day);
+void rule_set_day (Rule *rule, const int day, const bool value);
+uint8_t rule_days_from_array (const bool days[7]);
+void rule_days_to_array (const uint8_t mask, bool days[7]);
+
 #endif /* GAWAKE_TYPES_H_ */
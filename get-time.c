@@ -18,36 +18,108 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include <stdatomic.h>
+
 #include "get-time.h"
 
-// Get the system time (now) as struct tm
+static int
+system_now (struct timespec *now,
+            void            *user_data)
+{
+  (void) user_data;
+
+  return (clock_gettime (CLOCK_REALTIME, now) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int
+fake_now (struct timespec *now,
+          void            *user_data)
+{
+  const FakeTimeSource *self = user_data;
+
+  *now = self->now;
+  return EXIT_SUCCESS;
+}
+
+const TimeSource time_source_system = { .now = system_now, .user_data = NULL };
+
+static const TimeSource *_Atomic time_source = &time_source_system;
+
+void
+get_time_set_source (const TimeSource *source)
+{
+  atomic_store (&time_source, (source == NULL) ? &time_source_system : source);
+}
+
+void
+fake_time_source_init (FakeTimeSource *self,
+                       time_t          now)
+{
+  self->source = (TimeSource) { .now = fake_now, .user_data = self };
+  fake_time_source_set (self, now);
+}
+
+void
+fake_time_source_set (FakeTimeSource *self,
+                      time_t          now)
+{
+  self->now = (struct timespec) { .tv_sec = now, .tv_nsec = 0 };
+}
+
+// Get the time (now) as struct timespec
 int
-get_time_tm (struct tm **timeinfo)
+get_time_spec (struct timespec *time_now)
 {
-  time_t rawtime;
-  time (&rawtime);
+  const TimeSource *source = atomic_load (&time_source);
 
-  // If fails
-  if (rawtime == (time_t) -1)
+  if (source->now (time_now, source->user_data) == EXIT_FAILURE)
     {
       fprintf (stderr, "ERROR: failed while getting time\n");
       return EXIT_FAILURE;
     }
 
-  *timeinfo = localtime (&rawtime);
   return EXIT_SUCCESS;
 }
 
-// Get the system time (now) as time_t
+// Get the time (now) as time_t
 int
 get_time (time_t *time_now)
 {
-  time (time_now);
-  if (*time_now ==  (time_t) -1)
+  struct timespec now;
+
+  if (get_time_spec (&now) == EXIT_FAILURE)
     {
-      fprintf (stderr, "ERROR: failed while getting time\n");
+      *time_now = (time_t) -1;
       return EXIT_FAILURE;
     }
-  else
-    return EXIT_SUCCESS;
+
+  *time_now = now.tv_sec;
+  return EXIT_SUCCESS;
+}
+
+// Get the time (now) as struct tm, in local time
+int
+get_time_tm_r (struct tm *timeinfo)
+{
+  time_t now;
+
+  if (get_time (&now) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  if (localtime_r (&now, timeinfo) == NULL)
+    {
+      fprintf (stderr, "ERROR: failed while converting time\n");
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+int
+get_time_tm (struct tm **timeinfo)
+{
+  static _Thread_local struct tm buffer;
+
+  *timeinfo = &buffer;
+  return get_time_tm_r (&buffer);
 }
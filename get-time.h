@@ -1,3 +1,23 @@
+/* get-time.h
+ *
+ * Copyright 2021-2024 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
 #ifndef GET_TIME_H_
 #define GET_TIME_H_
 
@@ -5,7 +25,46 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-int get_time_tm (struct tm **timeinfo);
+// Where "now" comes from
+typedef struct
+{
+  int (*now) (struct timespec *now,
+              void            *user_data);
+  void *user_data;
+} TimeSource;
+
+// clock_gettime (CLOCK_REALTIME)
+extern const TimeSource time_source_system;
+
+/*
+ * Sets the time source of the process; NULL restores the system one. The
+ * source must stay valid while in use.
+ */
+void get_time_set_source (const TimeSource *source);
+
+// A time source frozen at a chosen instant, for tests and benchmarks
+typedef struct
+{
+  TimeSource source;
+  struct timespec now;
+} FakeTimeSource;
+
+void fake_time_source_init (FakeTimeSource *self,
+                            time_t          now);
+// Not synchronized: move it while no other thread reads the time
+void fake_time_source_set (FakeTimeSource *self,
+                           time_t          now);
+
+/*
+ * "Now", from the time source. Read it once per operation and derive
+ * everything else from that value, so the operation sees a single instant.
+ */
+int get_time_spec (struct timespec *time_now);
 int get_time (time_t *time_now);
+// Local time, in the caller's storage (reentrant)
+int get_time_tm_r (struct tm *timeinfo);
+// Prefer get_time_tm_r (): *timeinfo points to a per-thread buffer,
+// overwritten by the next call
+int get_time_tm (struct tm **timeinfo);
 
 #endif /* GET_TIME_H_ */
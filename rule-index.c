@@ -0,0 +1,354 @@
+/* rule-index.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "database-connection-utils.h"
+#include "rule-index.h"
+#include "rules-reader.h"
+#include "rule-validation.h"
+#include "debugger.h"
+
+#define INDEX_INITIAL_ALLOC 64
+
+static int
+compare_entries (const void *a,
+                 const void *b)
+{
+  const RuleIndexEntry *x = a;
+  const RuleIndexEntry *y = b;
+
+  if (x->minute != y->minute)
+    return (x->minute < y->minute) ? -1 : 1;
+
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+// Position of the first entry that doesn't come before (minute, id)
+static size_t
+lower_bound (const RuleIndex *index,
+             const int        minute,
+             const int        id)
+{
+  size_t low = 0, high = index->n_entries;
+
+  while (low < high)
+    {
+      size_t mid = low + (high - low) / 2;
+      const RuleIndexEntry *entry = &index->entries[mid];
+
+      if (entry->minute < minute || (entry->minute == minute && entry->id < id))
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  return low;
+}
+
+static int
+reserve (RuleIndex    *index,
+         const size_t  n)
+{
+  size_t allocated;
+  RuleIndexEntry *entries;
+
+  if (index->n_entries + n <= index->allocated)
+    return EXIT_SUCCESS;
+
+  allocated = (index->allocated > 0) ? index->allocated : INDEX_INITIAL_ALLOC;
+  while (allocated < index->n_entries + n)
+    allocated *= 2;
+
+  entries = realloc (index->entries, allocated * sizeof (RuleIndexEntry));
+  if (entries == NULL)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to allocate memory\n");
+      return EXIT_FAILURE;
+    }
+
+  index->entries = entries;
+  index->allocated = allocated;
+
+  return EXIT_SUCCESS;
+}
+
+// Inserts the occurrences of a rule at their sorted positions
+static int
+insert_rule (RuleIndex      *index,
+             const uint16_t  id,
+             const int       minute_of_day,
+             const uint8_t   days,
+             const uint8_t   mode)
+{
+  if (reserve (index, 7) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  for (int d = 0; d < 7; d++)
+    {
+      RuleIndexEntry entry = { .minute = d * 1440 + minute_of_day, .id = id, .mode = mode };
+      size_t pos;
+
+      if (!(days & DAY_BIT (d)))
+        continue;
+
+      pos = lower_bound (index, entry.minute, id);
+      memmove (&index->entries[pos + 1], &index->entries[pos],
+               (index->n_entries - pos) * sizeof (RuleIndexEntry));
+      index->entries[pos] = entry;
+      index->n_entries++;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+static void
+remove_rule (RuleIndex      *index,
+             const uint16_t  id)
+{
+  size_t kept = 0;
+
+  for (size_t i = 0; i < index->n_entries; i++)
+    {
+      if (index->entries[i].id != id)
+        index->entries[kept++] = index->entries[i];
+    }
+
+  index->n_entries = kept;
+}
+
+static int
+rebuild (DatabaseConnection *connection,
+         const Table         table,
+         const int64_t       data_version)
+{
+  RuleIndex *index = &connection->rule_index[table];
+  sqlite3_stmt *stmt;
+  int rc;
+
+  index->valid = false;
+  index->n_entries = 0;
+
+  stmt = utils_get_statement (connection, STATEMENT_UPCOMING_RULES, table);
+  if (stmt == NULL)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to query rules\n");
+      return EXIT_FAILURE;
+    }
+
+  // Appended unsorted, then sorted once
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      int minute_of_day = sqlite3_column_int (stmt, 1);
+      uint8_t days = (uint8_t) sqlite3_column_int (stmt, 2);
+
+      if (reserve (index, 7) == EXIT_FAILURE)
+        break;
+
+      for (int d = 0; d < 7; d++)
+        {
+          if (!(days & DAY_BIT (d)))
+            continue;
+
+          index->entries[index->n_entries++] = (RuleIndexEntry) {
+            .minute = d * 1440 + minute_of_day,
+            .id = (uint16_t) sqlite3_column_int (stmt, 0),
+            .mode = (uint8_t) ((table == TABLE_OFF) ? sqlite3_column_int (stmt, 3) : 0),
+          };
+        }
+    }
+
+  sqlite3_reset (stmt);
+
+  if (rc != SQLITE_DONE)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to build the rules index\n");
+      index->n_entries = 0;
+      return EXIT_FAILURE;
+    }
+
+  if (index->n_entries > 0)
+    qsort (index->entries, index->n_entries, sizeof (RuleIndexEntry), compare_entries);
+
+  index->valid = true;
+  index->data_version = data_version;
+
+  DEBUG_PRINT (("Rules index of %s rebuilt: %zu entries", TABLE[table], index->n_entries));
+
+  return EXIT_SUCCESS;
+}
+
+const RuleIndex *
+rule_index_get (DatabaseConnection *connection,
+                const Table         table)
+{
+  RuleIndex *index;
+  int64_t data_version;
+
+  connection = utils_get_connection (connection);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Database not connected\n");
+      return NULL;
+    }
+
+  if (rule_validate_table (table))
+    return NULL;
+
+  index = &connection->rule_index[table];
+
+  if (utils_get_data_version (connection, &data_version) == EXIT_FAILURE)
+    return NULL;
+
+  if ((!index->valid || index->data_version != data_version)
+      && rebuild (connection, table, data_version) == EXIT_FAILURE)
+    return NULL;
+
+  return index;
+}
+
+size_t
+rule_index_after (const RuleIndex *index,
+                  const int        minute)
+{
+  return lower_bound (index, minute + 1, 0);
+}
+
+int
+rule_index_next (DatabaseConnection *connection,
+                 const Table         table,
+                 const int           minute,
+                 RuleIndexEntry     *entry,
+                 bool               *found)
+{
+  const RuleIndex *index;
+  size_t pos;
+
+  *found = false;
+
+  index = rule_index_get (connection, table);
+  if (index == NULL)
+    return EXIT_FAILURE;
+
+  if (index->n_entries == 0)
+    return EXIT_SUCCESS;
+
+  // Wrap to the first occurrence of the next week
+  pos = rule_index_after (index, minute);
+  if (pos == index->n_entries)
+    pos = 0;
+
+  *entry = index->entries[pos];
+  *found = true;
+
+  return EXIT_SUCCESS;
+}
+
+// Returns NULL if there's nothing to patch
+static RuleIndex *
+get_patchable (DatabaseConnection *connection,
+               const Table         table)
+{
+  RuleIndex *index;
+
+  connection = utils_get_connection (connection);
+  if (connection == NULL || (table != TABLE_ON && table != TABLE_OFF))
+    return NULL;
+
+  index = &connection->rule_index[table];
+  if (!index->valid)
+    return NULL;
+
+  if (!sqlite3_get_autocommit (connection->db))
+    {
+      index->valid = false;
+      return NULL;
+    }
+
+  return index;
+}
+
+void
+rule_index_rule_changed (DatabaseConnection *connection,
+                         const Rule         *rule)
+{
+  RuleIndex *index = get_patchable (connection, rule->table);
+
+  if (index == NULL)
+    return;
+
+  remove_rule (index, rule->id);
+
+  if (rule->active
+      && insert_rule (index, rule->id, rule->hour * 60 + rule->minutes,
+                      rule->days, (uint8_t) rule->mode) == EXIT_FAILURE)
+    index->valid = false;
+}
+
+void
+rule_index_rule_enabled (DatabaseConnection *connection,
+                         const uint16_t      id,
+                         const Table         table,
+                         const bool          active)
+{
+  RuleIndex *index = get_patchable (connection, table);
+  Rule rule = { .id = 0 };
+
+  if (index == NULL)
+    return;
+
+  remove_rule (index, id);
+
+  if (!active)
+    return;
+
+  // The time and days of the rule aren't known here
+  if (rule_get_single_full (connection, id, table, &rule) == EXIT_FAILURE
+      || rule.id != id
+      || insert_rule (index, id, rule.hour * 60 + rule.minutes,
+                      rule.days, (uint8_t) rule.mode) == EXIT_FAILURE)
+    index->valid = false;
+}
+
+void
+rule_index_rule_removed (DatabaseConnection *connection,
+                         const uint16_t      id,
+                         const Table         table)
+{
+  RuleIndex *index = get_patchable (connection, table);
+
+  if (index != NULL)
+    remove_rule (index, id);
+}
+
+void
+rule_index_finalize (DatabaseConnection *connection)
+{
+  for (int t = 0; t < TABLE_LAST; t++)
+    {
+      free (connection->rule_index[t].entries);
+      connection->rule_index[t] = (RuleIndex) { 0 };
+    }
+}
@@ -0,0 +1,84 @@
+/* rule-index.h
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef RULE_INDEX_H_
+#define RULE_INDEX_H_
+
+#include "gawake-types.h"
+
+#define MINUTES_PER_WEEK (7 * 1440)
+
+// One occurrence of an active rule in the week
+typedef struct
+{
+  uint16_t minute;    // minute of the week [0, MINUTES_PER_WEEK), 0 being Sunday 00:00
+  uint16_t id;
+  uint8_t mode;       // turn off rules only
+} RuleIndexEntry;
+
+/*
+ * Occurrences sorted by (minute, id). It's built from the database on the
+ * first use, patched after each change made through its connection and
+ * rebuilt when PRAGMA data_version reveals a change made by another one.
+ */
+typedef struct
+{
+  bool valid;
+  int64_t data_version;
+  RuleIndexEntry *entries;
+  size_t n_entries;
+  size_t allocated;
+} RuleIndex;
+
+// Up-to-date index of a table, or NULL on failure; it stays valid until the
+// next call on the same connection
+const RuleIndex *rule_index_get (DatabaseConnection *connection,
+                                 const Table         table);
+// Position of the first occurrence strictly after "minute" (of the week);
+// index->n_entries if there isn't any until the end of the week
+size_t rule_index_after (const RuleIndex *index,
+                         const int        minute);
+
+/*
+ * Earliest occurrence strictly after "minute" (of the week), wrapping to the
+ * next week; an occurrence at "minute" itself is found a week later.
+ * *found is false if there isn't any active rule.
+ */
+int rule_index_next (DatabaseConnection *connection,
+                     const Table         table,
+                     const int           minute,
+                     RuleIndexEntry     *entry,
+                     bool               *found);
+
+// Patches the index after a successful change; inside a transaction, which
+// may still be rolled back, the index is invalidated instead
+void rule_index_rule_changed (DatabaseConnection *connection,
+                              const Rule         *rule);
+void rule_index_rule_enabled (DatabaseConnection *connection,
+                              const uint16_t      id,
+                              const Table         table,
+                              const bool          active);
+void rule_index_rule_removed (DatabaseConnection *connection,
+                              const uint16_t      id,
+                              const Table         table);
+
+void rule_index_finalize (DatabaseConnection *connection);
+
+#endif /* RULE_INDEX_H_ */
@@ -0,0 +1,330 @@
+/* rule-occurrence.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Rule occurrences computed in C from the local date, the minute of the day
+ * and the week days mask. Wall times are counted as seconds since
+ * 1970-01-01 00:00 local time; a table of UTC offsets maps them to
+ * instants, so libc is only asked for offsets when the table is built.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "rule-occurrence.h"
+#include "debugger.h"
+
+#define SECONDS_PER_DAY 86400
+#define TZ_WINDOW (18 * SECONDS_PER_DAY)
+#define TZ_WINDOW_BEFORE SECONDS_PER_DAY
+// Time zone changes are months apart; sampling finds them, bisecting
+// finds the exact second
+#define TZ_SAMPLE_STEP (6 * 3600)
+
+static int
+utc_offset (const time_t  instant,
+            long         *offset)
+{
+  struct tm local;
+
+  if (localtime_r (&instant, &local) == NULL)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to get the local time\n");
+      return EXIT_FAILURE;
+    }
+
+  *offset = local.tm_gmtoff;
+  return EXIT_SUCCESS;
+}
+
+#define ZONE_FILE "/etc/localtime"
+
+static uint64_t
+fingerprint_add (uint64_t    hash,
+                 const void *data,
+                 size_t      size)
+{
+  const unsigned char *byte = data;
+
+  // FNV-1a
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ byte[i]) * 1099511628211u;
+
+  return hash;
+}
+
+static uint64_t
+fingerprint_add_string (uint64_t    hash,
+                        const char *string)
+{
+  if (string == NULL)
+    return fingerprint_add (hash, "", 1);
+
+  return fingerprint_add (hash, string, strlen (string) + 1);
+}
+
+/*
+ * Identifies the current time zone: what tzset () read from TZ, and which
+ * /etc/localtime it would read. A stat () and a few hashed bytes, cheap
+ * enough to do once per computation.
+ */
+static uint64_t
+zone_fingerprint (void)
+{
+  uint64_t hash = 14695981039346656037u;
+  struct stat zone_file;
+
+  tzset ();
+
+  hash = fingerprint_add_string (hash, getenv ("TZ"));
+  hash = fingerprint_add_string (hash, tzname[0]);
+  hash = fingerprint_add_string (hash, tzname[1]);
+  hash = fingerprint_add (hash, &timezone, sizeof (timezone));
+  hash = fingerprint_add (hash, &daylight, sizeof (daylight));
+
+  if (stat (ZONE_FILE, &zone_file) == 0)
+    {
+      hash = fingerprint_add (hash, &zone_file.st_dev, sizeof (zone_file.st_dev));
+      hash = fingerprint_add (hash, &zone_file.st_ino, sizeof (zone_file.st_ino));
+      hash = fingerprint_add (hash, &zone_file.st_mtim, sizeof (zone_file.st_mtim));
+    }
+
+  return hash;
+}
+
+// Reads the offsets from "from" on
+static int
+build (TzOffsets    *self,
+       const time_t  from)
+{
+  time_t t;
+  long offset;
+
+  DEBUG_PRINT (("Building the time zone offsets table"));
+
+  self->valid = false;
+  self->zone = zone_fingerprint ();
+  self->from = from;
+  self->until = from + TZ_WINDOW;
+  self->n_spans = 1;
+  self->spans[0].start = self->from;
+
+  if (utc_offset (self->from, &self->spans[0].offset) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  for (t = self->from; t < self->until; t += TZ_SAMPLE_STEP)
+    {
+      time_t low = t, high = (t + TZ_SAMPLE_STEP < self->until) ? t + TZ_SAMPLE_STEP : self->until;
+
+      if (utc_offset (high, &offset) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+      if (offset == self->spans[self->n_spans - 1].offset)
+        continue;
+
+      if (self->n_spans == TZ_SPANS_MAX)
+        {
+          // Not a real time zone; cover less time instead
+          self->until = t;
+          break;
+        }
+
+      // The offset at "low" is the previous one: find the first second of the new one
+      while (high - low > 1)
+        {
+          time_t middle = low + (high - low) / 2;
+          long middle_offset;
+
+          if (utc_offset (middle, &middle_offset) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+          if (middle_offset == offset)
+            high = middle;
+          else
+            low = middle;
+        }
+
+      self->spans[self->n_spans++] = (TzSpan) { .start = high, .offset = offset };
+    }
+
+  self->valid = true;
+  return EXIT_SUCCESS;
+}
+
+// Makes sure the table covers [low, high], a few days at most
+static int
+ensure (TzOffsets    *self,
+        const time_t  low,
+        const time_t  high)
+{
+  if (self->valid && low >= self->from && high < self->until)
+    return EXIT_SUCCESS;
+
+  return build (self, low - TZ_WINDOW_BEFORE);
+}
+
+// Index of the span of an instant the table covers
+static int
+span_at (const TzOffsets *self,
+         const time_t     instant)
+{
+  int i = self->n_spans - 1;
+
+  while (i > 0 && instant < self->spans[i].start)
+    i--;
+
+  return i;
+}
+
+void
+tz_offsets_invalidate (TzOffsets *self)
+{
+  self->valid = false;
+}
+
+void
+tz_offsets_check_zone (TzOffsets *self)
+{
+  // The offsets of another time zone are of no use
+  if (self->valid && self->zone != zone_fingerprint ())
+    tz_offsets_invalidate (self);
+}
+
+// See http://howardhinnant.github.io/date_algorithms.html
+int64_t
+occurrence_days_from_date (const int year,
+                           const int month,
+                           const int day)
+{
+  int64_t y = (month <= 2) ? year - 1 : year;
+  int64_t era = ((y >= 0) ? y : y - 399) / 400;
+  int64_t year_of_era = y - era * 400;
+  int64_t day_of_year = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+  int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+  return era * 146097 + day_of_era - 719468;
+}
+
+void
+occurrence_date_from_days (const int64_t  days,
+                           int           *year,
+                           int           *month,
+                           int           *day)
+{
+  int64_t z = days + 719468;
+  int64_t era = ((z >= 0) ? z : z - 146096) / 146097;
+  int64_t day_of_era = z - era * 146097;
+  int64_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  int64_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  int64_t mp = (5 * day_of_year + 2) / 153;
+
+  *day = (int) (day_of_year - (153 * mp + 2) / 5 + 1);
+  *month = (int) ((mp < 10) ? mp + 3 : mp - 9);
+  *year = (int) (year_of_era + era * 400 + (*month <= 2));
+}
+
+static int64_t
+floor_div (const int64_t a,
+           const int64_t b)
+{
+  return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+int
+occurrence_weekday (const int64_t day)
+{
+  // 1970-01-01 was a Thursday
+  return (int) (((day + 4) % 7 + 7) % 7);
+}
+
+int
+occurrence_local (TzOffsets    *tz,
+                  const time_t  instant,
+                  int64_t      *day,
+                  int          *minute)
+{
+  int64_t wall;
+
+  if (ensure (tz, instant, instant) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  wall = (int64_t) instant + tz->spans[span_at (tz, instant)].offset;
+  *day = floor_div (wall, SECONDS_PER_DAY);
+  *minute = (int) ((wall - *day * SECONDS_PER_DAY) / 60);
+
+  return EXIT_SUCCESS;
+}
+
+int
+occurrence_at (TzOffsets     *tz,
+               const int64_t  day,
+               const int      minute,
+               Occurrence    *occurrence)
+{
+  int64_t wall = day * SECONDS_PER_DAY + (int64_t) minute * 60;
+  int64_t local_day;
+  int local_minute, n_valid = 0;
+  time_t epoch = 0;
+
+  // Offsets are within a day of UTC
+  if (ensure (tz, (time_t) (wall - SECONDS_PER_DAY), (time_t) (wall + SECONDS_PER_DAY)) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  // The wall time happens at "wall - offset" when that instant has that offset
+  for (int i = 0; i < tz->n_spans; i++)
+    {
+      time_t candidate = (time_t) (wall - tz->spans[i].offset);
+
+      if (span_at (tz, candidate) != i)
+        continue;
+      if (n_valid == 0 || candidate < epoch)
+        epoch = candidate;
+      n_valid++;
+    }
+
+  if (n_valid == 0)
+    {
+      /*
+       * Skipped by a forward change: counted with the offset before the
+       * change, it's moved forward by the length of the gap (like mktime)
+       */
+      epoch = (time_t) (wall - tz->spans[0].offset);
+      for (int i = 1; i < tz->n_spans; i++)
+        {
+          if (wall - tz->spans[i].offset < tz->spans[i].start
+              && wall - tz->spans[i - 1].offset >= tz->spans[i].start)
+            epoch = (time_t) (wall - tz->spans[i - 1].offset);
+        }
+      occurrence->dst = OCCURRENCE_DST_GAP;
+    }
+  else
+    occurrence->dst = (n_valid > 1) ? OCCURRENCE_DST_OVERLAP : OCCURRENCE_DST_NONE;
+
+  occurrence->epoch = epoch;
+
+  // Local date and time of the instant (differs from the input in a gap)
+  if (occurrence_local (tz, epoch, &local_day, &local_minute) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+  occurrence_date_from_days (local_day, &occurrence->year, &occurrence->month, &occurrence->day);
+  occurrence->hour = local_minute / 60;
+  occurrence->minutes = local_minute % 60;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+/* rule-occurrence.h
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef RULE_OCCURRENCE_H_
+#define RULE_OCCURRENCE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TZ_SPANS_MAX 8
+
+// An interval with a constant UTC offset (seconds east of UTC)
+typedef struct
+{
+  time_t start;
+  long offset;
+} TzSpan;
+
+/*
+ * UTC offsets of the local time zone over a window of a couple of weeks,
+ * read once from libc; instants outside the window rebuild it. A change of
+ * the time zone itself (TZ or /etc/localtime) is noticed by
+ * tz_offsets_check_zone (), which drops the table then.
+ */
+typedef struct
+{
+  bool valid;
+  uint64_t zone;                // fingerprint of the time zone the table was built for
+  time_t from;
+  time_t until;
+  int n_spans;
+  TzSpan spans[TZ_SPANS_MAX];   // spans[0].start == from
+} TzOffsets;
+
+typedef enum
+{
+  OCCURRENCE_DST_NONE,
+  OCCURRENCE_DST_GAP,       // the wall time was skipped: moved forward by the gap length
+  OCCURRENCE_DST_OVERLAP    // the wall time happens twice: the earlier instant
+} OccurrenceDst;
+
+typedef struct
+{
+  time_t epoch;
+  int year;                 // local date and time of "epoch"
+  int month;
+  int day;
+  int hour;
+  int minutes;
+  OccurrenceDst dst;
+} Occurrence;
+
+void tz_offsets_invalidate (TzOffsets *self);
+// Costs a tzset () and a stat (): call it once per operation, before the
+// occurrences are computed
+void tz_offsets_check_zone (TzOffsets *self);
+
+// Days since 1970-01-01 of a proleptic Gregorian date, and back
+int64_t occurrence_days_from_date (const int year,
+                                   const int month,
+                                   const int day);
+void occurrence_date_from_days (const int64_t days,
+                                int          *year,
+                                int          *month,
+                                int          *day);
+
+// Week day of a date (days since 1970-01-01); 0 is Sunday
+int occurrence_weekday (const int64_t day);
+
+// Local date (days since 1970-01-01) and minute of the day of an instant
+int occurrence_local (TzOffsets *tz,
+                      const time_t instant,
+                      int64_t *day,
+                      int *minute);
+
+// The instant a local date (days since 1970-01-01) and minute of the day happen
+int occurrence_at (TzOffsets *tz,
+                   const int64_t day,
+                   const int minute,
+                   Occurrence *occurrence);
+
+#endif /* RULE_OCCURRENCE_H_ */
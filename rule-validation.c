@@ -24,14 +24,49 @@
 #include <time.h>
 
 #include "debugger.h"
+#include "database-connection-utils.h"
+#include "configuration-reader.h"
 #include "rules-reader.h"
 #include "rule-validation.h"
 #include "get-time.h"
+#include "rule-occurrence.h"
 
+#define SLOTS (7 * 1440)         // (week day, minute of the day)
+#define NO_NODE (-1)
+#define VALIDATOR_INITIAL_ALLOC 16
+
+// A rule id in the list of a slot
+typedef struct
+{
+  uint16_t id;
+  int32_t next;
+} SlotNode;
+
+// The time of a rule, to find its nodes when it's removed
+typedef struct
+{
+  uint16_t id;
+  uint16_t minute;        // of the day
+  uint8_t days;
+} ValidatorEntry;
+
+/*
+ * Each slot heads a list of the rules set on that week day and minute;
+ * nodes come from a pool, reusing the freed ones. Entries are sorted by id.
+ */
 struct _RuleTimeValidator
 {
-  uint16_t row_count;
-  Rule *rules;
+  Table table;
+  int32_t slots[SLOTS];
+
+  SlotNode *nodes;
+  size_t n_nodes;
+  size_t allocated_nodes;
+  int32_t free_nodes;
+
+  ValidatorEntry *entries;
+  size_t n_entries;
+  size_t allocated_entries;
 };
 
 int
@@ -48,6 +83,9 @@ rule_validate_rule (const Rule *rule)
   // minutes [0, 59]
   bool minutes = rule->minutes <= 59;
 
+  // days: only the seven week day bits
+  bool days = (rule->days & ~DAYS_ALL) == 0;
+
   // table
   bool table = (rule->table == TABLE_ON || rule->table == TABLE_OFF);
 
@@ -58,10 +96,10 @@ rule_validate_rule (const Rule *rule)
     mode = true;
 
   DEBUG_PRINT (("VALIDATION:\nName: %d\n\tName length: %lu\n"\
-                "Hour: %d\nMinutes: %d\nMode: %d\nTable: %d",
-                name, strlen (rule->name), hour, minutes, mode, table));
+                "Hour: %d\nMinutes: %d\nDays: %d\nMode: %d\nTable: %d",
+                name, strlen (rule->name), hour, minutes, days, mode, table));
 
-  if (name && hour && minutes && mode && table)
+  if (name && hour && minutes && days && mode && table)
     return EXIT_SUCCESS;
   else
     {
@@ -82,23 +120,224 @@ rule_validate_table (const Table table)
 
 RuleTimeValidator *
 rule_validate_time_init (const Table table)
+{
+  return rule_validate_time_init_full (NULL, table);
+}
+
+// Grows an array of "size" sized elements to hold at least n of them
+static int
+grow (void   **array,
+      size_t  *allocated,
+      size_t   n,
+      size_t   size)
+{
+  size_t new_allocated;
+  void *tmp;
+
+  if (n <= *allocated)
+    return EXIT_SUCCESS;
+
+  new_allocated = (*allocated > 0) ? *allocated : VALIDATOR_INITIAL_ALLOC;
+  while (new_allocated < n)
+    new_allocated *= 2;
+
+  tmp = realloc (*array, new_allocated * size);
+  if (tmp == NULL)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to allocate memory\n");
+      return EXIT_FAILURE;
+    }
+
+  *array = tmp;
+  *allocated = new_allocated;
+  return EXIT_SUCCESS;
+}
+
+// Position of the entry with the id, or where it would be inserted
+static size_t
+find_entry (const RuleTimeValidator *self,
+            const uint16_t           id)
+{
+  size_t low = 0, high = self->n_entries;
+
+  while (low < high)
+    {
+      size_t mid = low + (high - low) / 2;
+
+      if (self->entries[mid].id < id)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  return low;
+}
+
+static void
+unlink_rule (RuleTimeValidator    *self,
+             const ValidatorEntry *entry)
+{
+  for (int d = 0; d < 7; d++)
+    {
+      int32_t *link;
+
+      if (!(entry->days & DAY_BIT (d)))
+        continue;
+
+      for (link = &self->slots[d * 1440 + entry->minute];
+           *link != NO_NODE;
+           link = &self->nodes[*link].next)
+        {
+          if (self->nodes[*link].id == entry->id)
+            {
+              int32_t node = *link;
+
+              *link = self->nodes[node].next;
+              self->nodes[node].next = self->free_nodes;
+              self->free_nodes = node;
+              break;
+            }
+        }
+    }
+}
+
+void
+rule_validate_time_remove (RuleTimeValidator *self,
+                           const uint16_t     id)
+{
+  size_t pos;
+
+  if (self == NULL)
+    return;
+
+  pos = find_entry (self, id);
+  if (pos == self->n_entries || self->entries[pos].id != id)
+    return;
+
+  unlink_rule (self, &self->entries[pos]);
+
+  memmove (&self->entries[pos], &self->entries[pos + 1],
+           (self->n_entries - pos - 1) * sizeof (ValidatorEntry));
+  self->n_entries--;
+}
+
+int
+rule_validate_time_insert (RuleTimeValidator *self,
+                           const Rule        *rule)
+{
+  ValidatorEntry entry;
+  size_t pos;
+
+  if (self == NULL || rule->hour > 23 || rule->minutes > 59)
+    return EXIT_FAILURE;
+
+  entry = (ValidatorEntry) {
+    .id = rule->id,
+    .minute = rule->hour * 60 + rule->minutes,
+    .days = rule->days & DAYS_ALL,
+  };
+
+  // Reserve everything upfront, so nothing is left half inserted
+  if (grow ((void **) &self->entries, &self->allocated_entries,
+            self->n_entries + 1, sizeof (ValidatorEntry))
+      || grow ((void **) &self->nodes, &self->allocated_nodes,
+               self->n_nodes + 7, sizeof (SlotNode)))
+    return EXIT_FAILURE;
+
+  pos = find_entry (self, entry.id);
+  if (pos < self->n_entries && self->entries[pos].id == entry.id)
+    unlink_rule (self, &self->entries[pos]);
+  else
+    {
+      memmove (&self->entries[pos + 1], &self->entries[pos],
+               (self->n_entries - pos) * sizeof (ValidatorEntry));
+      self->n_entries++;
+    }
+  self->entries[pos] = entry;
+
+  for (int d = 0; d < 7; d++)
+    {
+      int32_t node;
+      int32_t *slot = &self->slots[d * 1440 + entry.minute];
+
+      if (!(entry.days & DAY_BIT (d)))
+        continue;
+
+      if (self->free_nodes != NO_NODE)
+        {
+          node = self->free_nodes;
+          self->free_nodes = self->nodes[node].next;
+        }
+      else
+        node = (int32_t) self->n_nodes++;
+
+      self->nodes[node] = (SlotNode) { .id = entry.id, .next = *slot };
+      *slot = node;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+typedef struct
+{
+  RuleTimeValidator *validator;
+  int status;
+} InitData;
+
+static bool
+init_insert_rule (const Rule *rule,
+                  void       *user_data)
+{
+  InitData *data = user_data;
+
+  data->status = rule_validate_time_insert (data->validator, rule);
+  return data->status == EXIT_SUCCESS;
+}
+
+static RuleTimeValidator *
+time_init (DatabaseConnection *connection,
+           const Table table)
 {
   RuleTimeValidator *time_validator = NULL;
-  int status = 0;
+  InitData data;
 
-  time_validator = malloc (sizeof (RuleTimeValidator));
+  time_validator = calloc (1, sizeof (RuleTimeValidator));
+  if (time_validator == NULL)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to allocate memory\n");
+      return NULL;
+    }
 
-  status = rule_get_all (table, &time_validator->rules, &time_validator->row_count);
+  time_validator->table = table;
+  for (int i = 0; i < SLOTS; i++)
+    time_validator->slots[i] = NO_NODE;
+  time_validator->free_nodes = NO_NODE;
 
-  if (status == EXIT_FAILURE)
+  // Streamed, so the table isn't loaded as a whole
+  data = (InitData) { .validator = time_validator, .status = EXIT_SUCCESS };
+  if (rule_foreach (connection, table, NULL, init_insert_rule, &data) == EXIT_FAILURE
+      || data.status == EXIT_FAILURE)
     {
-      free (time_validator);
+      rule_validate_time_finalize (&time_validator);
       return NULL;
     }
 
   return time_validator;
 }
 
+RuleTimeValidator *
+rule_validate_time_init_full (DatabaseConnection *connection,
+                              const Table table)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_VALIDATE);
+  RuleTimeValidator *ret = time_init (connection, table);
+
+  profile_end (connection, previous);
+  return ret;
+}
+
 uint16_t
 rule_validate_time (RuleTimeValidator *self,
                     const uint16_t rule_id,
@@ -106,6 +345,19 @@ rule_validate_time (RuleTimeValidator *self,
                     const uint8_t minutes,
                     const bool days[7])
 {
+  return rule_validate_time_days (self, rule_id, hour, minutes,
+                                  rule_days_from_array (days));
+}
+
+uint16_t
+rule_validate_time_days (RuleTimeValidator *self,
+                         const uint16_t rule_id,
+                         const uint8_t hour,
+                         const uint8_t minutes,
+                         const uint8_t days)
+{
+  uint16_t conflict = 0;
+
   if (self == NULL)
     {
       DEBUG_PRINT_CONTEX;
@@ -114,42 +366,388 @@ rule_validate_time (RuleTimeValidator *self,
       return 1;
     }
 
-  // Loop for all rules
-  for (int idx = 0; idx < self->row_count; idx++)
+  // Invalid times can't conflict with any rule
+  if (hour > 23 || minutes > 59)
+    return 0;
+
+  // Only the slots of the given days are visited; report the lowest id
+  for (int d = 0; d < 7; d++)
+    {
+      if (!(days & DAY_BIT (d)))
+        continue;
+
+      for (int32_t node = self->slots[d * 1440 + hour * 60 + minutes];
+           node != NO_NODE;
+           node = self->nodes[node].next)
+        {
+          uint16_t id = self->nodes[node].id;
+
+          if (id != rule_id && (conflict == 0 || id < conflict))
+            conflict = id;
+        }
+    }
+
+  return conflict;
+}
+
+typedef struct
+{
+  RuleConflict *items;
+  size_t n_items;
+  size_t allocated;
+} ConflictList;
+
+static int
+add_conflict (ConflictList       *list,
+              const RuleConflict  conflict)
+{
+  if (grow ((void **) &list->items, &list->allocated,
+            list->n_items + 1, sizeof (RuleConflict)))
+    return EXIT_FAILURE;
+
+  list->items[list->n_items++] = conflict;
+  return EXIT_SUCCESS;
+}
+
+static int
+compare_ids (const void *a,
+             const void *b)
+{
+  uint16_t x = *(const uint16_t *) a;
+  uint16_t y = *(const uint16_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+// A valid rule of the set, sorted by (table, minute of the day, position)
+typedef struct
+{
+  uint32_t key;
+  size_t index;
+} SortItem;
+
+static int
+compare_items (const void *a,
+               const void *b)
+{
+  const SortItem *x = a;
+  const SortItem *y = b;
+
+  if (x->key != y->key)
+    return (x->key < y->key) ? -1 : 1;
+
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+static int
+compare_conflicts (const void *a,
+                   const void *b)
+{
+  const RuleConflict *x = a;
+  const RuleConflict *y = b;
+
+  if (x->index != y->index)
+    return (x->index < y->index) ? -1 : 1;
+  if (x->kind != y->kind)
+    return (x->kind < y->kind) ? -1 : 1;
+  if (x->other_index != y->other_index)
+    return (x->other_index < y->other_index) ? -1 : 1;
+
+  return (x->other_id > y->other_id) - (x->other_id < y->other_id);
+}
+
+// Conflicts of a valid rule of the set with the rules of the validator
+static int
+check_database (const RuleTimeValidator *self,
+                const Rule              *rule,
+                const size_t             index,
+                const uint16_t          *edited,
+                const size_t             n_edited,
+                ConflictList            *list)
+{
+  int minute = rule->hour * 60 + rule->minutes;
+
+  for (int d = 0; d < 7; d++)
+    {
+      if (!(rule->days & DAY_BIT (d)))
+        continue;
+
+      for (int32_t node = self->slots[d * 1440 + minute];
+           node != NO_NODE;
+           node = self->nodes[node].next)
+        {
+          uint16_t id = self->nodes[node].id;
+          size_t pos;
+
+          // The set replaces the rules it edits, which are checked within the set
+          if (id == rule->id
+              || bsearch (&id, edited, n_edited, sizeof (uint16_t), compare_ids) != NULL)
+            continue;
+
+          // Report each rule once, with all the days they share
+          pos = find_entry (self, id);
+          if (d > 0 && (self->entries[pos].days & rule->days & (DAY_BIT (d) - 1)))
+            continue;
+
+          if (add_conflict (list, (RuleConflict) {
+                .kind = RULE_CONFLICT_DATABASE,
+                .index = index,
+                .other_id = id,
+                .days = self->entries[pos].days & rule->days,
+              }))
+            return EXIT_FAILURE;
+        }
+    }
+
+  return EXIT_SUCCESS;
+}
+
+int
+rule_validate_time_batch (RuleTimeValidator  *self,
+                          const Rule         *rules,
+                          const size_t        n_rules,
+                          RuleConflict      **conflicts,
+                          size_t             *n_conflicts)
+{
+  ConflictList list = { 0 };
+  SortItem *order = NULL;
+  size_t n_valid = 0, n_edited = 0;
+  uint16_t *edited = NULL;
+
+  *conflicts = NULL;
+  *n_conflicts = 0;
+
+  if (n_rules == 0)
+    return EXIT_SUCCESS;
+
+  order = malloc (n_rules * sizeof (SortItem));
+  edited = malloc (n_rules * sizeof (uint16_t));
+  if (order == NULL || edited == NULL)
     {
-      // Loop for each rule's day
-      for (int d = 0; d < 7; d++)
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to allocate memory\n");
+      goto error;
+    }
+
+  // Invalid rules are reported and left out of the time checks
+  for (size_t i = 0; i < n_rules; i++)
+    {
+      if (rule_validate_rule (&rules[i]) == EXIT_FAILURE)
         {
-          if ((self->rules[idx].days[d] && days[d]
-               && self->rules[idx].id != rule_id)
-              && self->rules[idx].hour == hour
-              && self->rules[idx].minutes == minutes)
-            return self->rules[idx].id;
+          if (add_conflict (&list, (RuleConflict) { .kind = RULE_CONFLICT_INVALID, .index = i }))
+            goto error;
+          continue;
         }
+
+      order[n_valid++] = (SortItem) {
+        .key = (uint32_t) rules[i].table * 1440 + rules[i].hour * 60 + rules[i].minutes,
+        .index = i,
+      };
+      if (self != NULL && rules[i].table == self->table && rules[i].id != 0)
+        edited[n_edited++] = rules[i].id;
+    }
+
+  qsort (edited, n_edited, sizeof (uint16_t), compare_ids);
+
+  // Against the database
+  for (size_t i = 0; self != NULL && i < n_valid; i++)
+    {
+      const Rule *rule = &rules[order[i].index];
+
+      if (rule->table == self->table
+          && check_database (self, rule, order[i].index, edited, n_edited, &list))
+        goto error;
     }
 
-  return 0;
+  /*
+   * Within the set: only rules of the same table and minute can collide, so
+   * each rule is compared to the earlier ones of its run of equal keys
+   * (sorted by index). With seven days, a run of k rules holds on the order
+   * of k * k colliding pairs anyway
+   */
+  qsort (order, n_valid, sizeof (SortItem), compare_items);
+
+  for (size_t start = 0, end; start < n_valid; start = end)
+    {
+      for (end = start; end < n_valid && order[end].key == order[start].key; end++)
+        {
+          size_t index = order[end].index;
+          uint8_t days = rules[index].days & DAYS_ALL;
+
+          // A conflict per earlier rule, with all the days they share
+          for (size_t j = start; days != 0 && j < end; j++)
+            {
+              size_t other = order[j].index;
+              uint8_t shared = days & rules[other].days;
+
+              if (shared != 0
+                  && add_conflict (&list, (RuleConflict) {
+                       .kind = RULE_CONFLICT_SET,
+                       .index = other,
+                       .other_index = index,
+                       .days = shared,
+                     }))
+                goto error;
+            }
+        }
+    }
+
+  if (list.n_items > 0)
+    qsort (list.items, list.n_items, sizeof (RuleConflict), compare_conflicts);
+
+  free (order);
+  free (edited);
+
+  *conflicts = list.items;
+  *n_conflicts = list.n_items;
+
+  return EXIT_SUCCESS;
+
+error:
+  free (order);
+  free (edited);
+  free (list.items);
+  return EXIT_FAILURE;
+}
+
+// Minute of the week of the turn on occurrence "i" of a timeline that
+// spans from the previous week to the next one
+static int
+spread_minute (const RuleIndex *index,
+               const size_t     i)
+{
+  return index->entries[i % index->n_entries].minute
+         + ((int) (i / index->n_entries) - 1) * MINUTES_PER_WEEK;
+}
+
+static int
+cross_tables (DatabaseConnection  *connection,
+              const int            tolerance,
+              CrossConflict      **conflicts,
+              size_t              *n_conflicts)
+{
+  const RuleIndex *on, *off;
+  CrossConflict *items = NULL;
+  size_t n_items = 0, allocated = 0, low = 0, high = 0, n_spread;
+  int notification_time, notice;
+
+  *conflicts = NULL;
+  *n_conflicts = 0;
+
+  if (tolerance < 0 || tolerance > 1440)
+    {
+      fprintf (stderr, "ERROR: Tolerance must be from 0 to 1440 minutes\n");
+      return EXIT_FAILURE;
+    }
+
+  if (configuration_get_notification_time_full (connection, &notification_time) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  // The config holds seconds; the timeline, minutes
+  notice = (notification_time + 59) / 60;
+
+  off = rule_index_get (connection, TABLE_OFF);
+  on = rule_index_get (connection, TABLE_ON);
+  if (off == NULL || on == NULL)
+    return EXIT_FAILURE;
+
+  if (off->n_entries == 0 || on->n_entries == 0)
+    return EXIT_SUCCESS;
+
+  /*
+   * Sweep the turn off occurrences in order; the window of turn on
+   * occurrences [minute - notice, minute + tolerance] only moves forward,
+   * over three copies of the week to handle the wrap around
+   */
+  n_spread = 3 * on->n_entries;
+
+  for (size_t i = 0; i < off->n_entries; i++)
+    {
+      const RuleIndexEntry *entry = &off->entries[i];
+      int from = entry->minute - notice;
+      int to = entry->minute + tolerance;
+
+      while (low < n_spread && spread_minute (on, low) < from)
+        low++;
+      if (high < low)
+        high = low;
+      while (high < n_spread && spread_minute (on, high) <= to)
+        high++;
+
+      for (size_t j = low; j < high; j++)
+        {
+          if (grow ((void **) &items, &allocated, n_items + 1, sizeof (CrossConflict)))
+            {
+              free (items);
+              return EXIT_FAILURE;
+            }
+
+          items[n_items++] = (CrossConflict) {
+            .turnoff_id = entry->id,
+            .turnon_id = on->entries[j % on->n_entries].id,
+            .minute = entry->minute,
+            .gap = spread_minute (on, j) - entry->minute,
+          };
+        }
+    }
+
+  *conflicts = items;
+  *n_conflicts = n_items;
+
+  return EXIT_SUCCESS;
+}
+
+int
+rule_validate_cross_tables (DatabaseConnection  *connection,
+                            const int            tolerance,
+                            CrossConflict      **conflicts,
+                            size_t              *n_conflicts)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_VALIDATE);
+  int ret = cross_tables (connection, tolerance, conflicts, n_conflicts);
+
+  profile_end (connection, previous);
+  return ret;
 }
 
 void
 rule_validate_time_finalize (RuleTimeValidator **self)
 {
+  if (*self == NULL)
+    return;
+
+  free ((*self)->nodes);
+  free ((*self)->entries);
   free (*self);
-  self = NULL;
+  *self = NULL;
 }
 
 int
 rule_validade_rtcwake_args (const RtcwakeArgs *rtcwake_args)
+{
+  time_t now;
+
+  if (get_time (&now) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  return rule_validade_rtcwake_args_at (rtcwake_args, now);
+}
+
+int
+rule_validade_rtcwake_args_at (const RtcwakeArgs *rtcwake_args,
+                               const time_t       now)
 {
   bool hour, minutes, date, year, mode;
   int ret;
-  struct tm *timeinfo;
-  struct tm input = {
-    .tm_mday = rtcwake_args->day,
-    .tm_mon = rtcwake_args->month - 1,
-    .tm_year = rtcwake_args->year - 1900,
-  };
-  time_t generated_time = mktime (&input);
+  int day, month, year_check;
+  struct tm local;
+
+  if (localtime_r (&now, &local) == NULL)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to get the local time\n");
+      return EXIT_FAILURE;
+    }
 
   DEBUG_PRINT (("Validating rtcwake_args..."));
   hour = minutes = date = year  = mode = false;
@@ -163,18 +761,20 @@ rule_validade_rtcwake_args (const RtcwakeArgs *rtcwake_args)
     minutes = true;
 
   // Date
-  timeinfo = localtime (&generated_time);
-  if (generated_time == -1
-      || rtcwake_args->day != timeinfo->tm_mday
-      || rtcwake_args->month != timeinfo->tm_mon + 1
-      || rtcwake_args->year != timeinfo->tm_year + 1900)
+  occurrence_date_from_days (occurrence_days_from_date (rtcwake_args->year,
+                                                       rtcwake_args->month,
+                                                       rtcwake_args->day),
+                             &year_check, &month, &day);
+  if (rtcwake_args->month < 1 || rtcwake_args->month > 12
+      || rtcwake_args->day != day
+      || rtcwake_args->month != month
+      || rtcwake_args->year != year_check)
     date = false;
   else
     date = true;
 
   // Year (must be this year or at most the next, only)
-  get_time_tm (&timeinfo);
-  if (rtcwake_args->year > (timeinfo->tm_year + 1900 + 1))
+  if (rtcwake_args->year > (local.tm_year + 1900 + 1))
     year = false;
   else
     year = true;
@@ -206,7 +806,7 @@ rule_validade_rtcwake_args (const RtcwakeArgs *rtcwake_args)
   DEBUG_PRINT (("RtcwakeArgs validation:\n"\
                 "\tHour: %d\n\tMinutes: %d\n\tDate: %d\n\tYear: %d\n"\
                 "\tMode: %d\n\tthis_year: %d\n\t--> Status (1 if not passed): %d",
-                hour, minutes, date, year, mode, timeinfo->tm_year + 1900, ret));
+                hour, minutes, date, year, mode, now.tm_year + 1900, ret));
 
   return ret;
 }
@@ -21,6 +21,8 @@
 #ifndef RULE_VALIDATION_H_
 #define RULE_VALIDATION_H_
 
+#include <stddef.h>
+
 #include "gawake-types.h"
 
 typedef struct _RuleTimeValidator RuleTimeValidator;
@@ -28,8 +30,13 @@ typedef struct _RuleTimeValidator RuleTimeValidator;
 int rule_validate_rule (const Rule *rule);
 int rule_validate_table (const Table table);
 int rule_validade_rtcwake_args (const RtcwakeArgs *rtcwake_args);
+// Same, against the "now" the caller already read for the operation
+int rule_validade_rtcwake_args_at (const RtcwakeArgs *rtcwake_args,
+                                   const time_t       now);
 
 RuleTimeValidator *rule_validate_time_init (const Table table);
+RuleTimeValidator *rule_validate_time_init_full (DatabaseConnection *connection,
+                                                 const Table table);
 /*
  * Arguments:
  *  rule_id: [1] if a new rule is being created, pass 0
@@ -47,6 +54,73 @@ uint16_t rule_validate_time (RuleTimeValidator *self,
                              const uint8_t hour,
                              const uint8_t minutes,
                              const bool days[7]);
+// Same as rule_validate_time, with the days as a mask (see DAY_BIT)
+uint16_t rule_validate_time_days (RuleTimeValidator *self,
+                                  const uint16_t rule_id,
+                                  const uint8_t hour,
+                                  const uint8_t minutes,
+                                  const uint8_t days);
+/*
+ * Keep the validator in sync with the table without reloading it: insert
+ * also replaces a rule with the same id (e.g. after an edit)
+ */
+int rule_validate_time_insert (RuleTimeValidator *self,
+                               const Rule *rule);
+void rule_validate_time_remove (RuleTimeValidator *self,
+                                const uint16_t id);
+
+typedef enum
+{
+  RULE_CONFLICT_INVALID,      // the rule itself is invalid (see rule_validate_rule)
+  RULE_CONFLICT_DATABASE,     // collides with other_id, already in the database
+  RULE_CONFLICT_SET           // collides with other_index, of the same set
+} RuleConflictKind;
+
+typedef struct
+{
+  RuleConflictKind kind;
+  size_t index;               // position of the rule in the set
+  size_t other_index;         // RULE_CONFLICT_SET only; always > index
+  uint16_t other_id;          // RULE_CONFLICT_DATABASE only
+  uint8_t days;               // days on which they collide
+} RuleConflict;
+
+/*
+ * Checks a whole set of rules before applying it, reporting the conflicts
+ * ordered by index. Within the set, every colliding pair is reported once,
+ * with all the days they share: k rules sharing a time and day give
+ * k * (k - 1) / 2 conflicts. Rules with an id replace that rule of the
+ * database, as rule_edit() would. "self" may be NULL to check the set on its
+ * own; it's only compared to the rules of its table. The array must be
+ * freed by the caller.
+ */
+int rule_validate_time_batch (RuleTimeValidator  *self,
+                              const Rule         *rules,
+                              const size_t        n_rules,
+                              RuleConflict      **conflicts,
+                              size_t             *n_conflicts);
+
+// A turn on occurrence too close to a turn off one
+typedef struct
+{
+  uint16_t turnoff_id;
+  uint16_t turnon_id;
+  uint16_t minute;            // of the week, of the turn off occurrence (0: Sunday 00:00)
+  int gap;                    // minutes from the turn off to the turn on; < 0 if it comes before
+} CrossConflict;
+
+/*
+ * Finds the active turn on rules firing from "notification_time" before, to
+ * "tolerance" minutes after, an active turn off rule, over the weekly
+ * timeline; one entry per occurrence, ordered by the turn off minute. The
+ * notification time is read from the config, in seconds, and rounded up to
+ * whole minutes. tolerance: [0, 1440]. The array must be freed by the
+ * caller.
+ */
+int rule_validate_cross_tables (DatabaseConnection  *connection,
+                                const int            tolerance,
+                                CrossConflict      **conflicts,
+                                size_t              *n_conflicts);
 void rule_validate_time_finalize (RuleTimeValidator **self);
 
 
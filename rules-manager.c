@@ -24,67 +24,128 @@
 #include "database-connection-utils.h"
 #include "rule-validation.h"
 #include "rules-manager.h"
+#include "debugger.h"
+
+#define BATCH_INITIAL_ALLOC 16
+
+typedef struct
+{
+  RuleBatchOperation operation;
+  // RULE_BATCH_DELETE and RULE_BATCH_ENABLE_DISABLE only use id, table (and active)
+  Rule rule;
+} BatchItem;
+
+struct _RuleBatch
+{
+  DatabaseConnection *connection;
+  bool abort_on_error;
+  BatchItem *items;
+  size_t n_items;
+  size_t allocated;
+};
+
+// Binds the rule fields, following the parameters order of
+// STATEMENT_RULE_ADD and STATEMENT_RULE_EDIT
+static void
+bind_rule (sqlite3_stmt *stmt,
+           const Rule   *rule)
+{
+  sqlite3_bind_text (stmt, 1, rule->name, -1, SQLITE_STATIC);
+  // Time as minute of the day
+  sqlite3_bind_int (stmt, 2, rule->hour * 60 + rule->minutes);
+  sqlite3_bind_int (stmt, 3, rule->days);
+  sqlite3_bind_int (stmt, 4, rule->active);
+
+  // The mode parameter only exists on turn off rules
+  if (rule->table == TABLE_OFF)
+    sqlite3_bind_int (stmt, 5, rule->mode);
+}
 
 // Returns 0 if fails
 // returns > 0 as the rule id
 uint16_t
 rule_add (const Rule *rule)
 {
+  return rule_add_full (NULL, rule);
+}
+
+static uint16_t
+add_rule (DatabaseConnection *connection,
+          const Rule         *rule)
+{
+  sqlite3_stmt *stmt;
+
   if (rule_validate_rule (rule))
     return 0;
 
-  switch (rule->table)
-    {
-    case TABLE_ON:
-      sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                        "INSERT INTO rules_turnon "\
-                        "(rule_name, rule_time, sun, mon, tue, wed, thu, fri, sat, active) "\
-                        "VALUES ('%s', '%02d:%02u:00', %d, %d, %d, %d, %d, %d, %d, %d);",
-                        rule->name,
-                        rule->hour,
-                        rule->minutes,
-                        rule->days[0], rule->days[1], rule->days[2], rule->days[3],
-                        rule->days[4], rule->days[5], rule->days[6],
-                        rule->active);
-      break;
-
-    case TABLE_OFF:
-      sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                        "INSERT INTO rules_turnoff "\
-                        "(rule_name, rule_time, sun, mon, tue, wed, thu, fri, sat, active, mode) "\
-                        "VALUES ('%s', '%02d:%02u:00', %d, %d, %d, %d, %d, %d, %d, %d, %u);",
-                        rule->name,
-                        rule->hour,
-                        rule->minutes,
-                        rule->days[0], rule->days[1], rule->days[2], rule->days[3],
-                        rule->days[4], rule->days[5], rule->days[6],
-                        rule->active,
-                        rule->mode);
-      break;
-
-    case TABLE_LAST:
-      return 0;
+  stmt = utils_get_statement (connection, STATEMENT_RULE_ADD, rule->table);
+  if (stmt == NULL)
+    return 0;
 
-    default:
-      return 0;
-    }
+  bind_rule (stmt, rule);
 
-  if (utils_run_sql () == EXIT_SUCCESS)
-    return ((uint16_t) sqlite3_last_insert_rowid (utils_get_pdb ()));
+  if (utils_run_statement (connection, stmt) == EXIT_SUCCESS)
+    {
+      Rule added = *rule;
+      added.id = (uint16_t) sqlite3_last_insert_rowid (sqlite3_db_handle (stmt));
+      rule_index_rule_changed (connection, &added);
+      return added.id;
+    }
   else
     return 0;
 }
 
+uint16_t
+rule_add_full (DatabaseConnection *connection,
+               const Rule         *rule)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_ADD);
+  uint16_t ret = add_rule (connection, rule);
+
+  profile_end (connection, previous);
+  return ret;
+}
+
 int
 rule_delete (const uint16_t id,
              const Table table)
 {
+  return rule_delete_full (NULL, id, table);
+}
+
+static int
+delete_rule (DatabaseConnection *connection,
+             const uint16_t id,
+             const Table table)
+{
+  sqlite3_stmt *stmt;
+
   if (rule_validate_table (table))
     return EXIT_FAILURE;
 
-  sqlite3_snprintf (SQL_SIZE, utils_get_sql (), "DELETE FROM %s WHERE id = %d;", TABLE[table], id);
+  stmt = utils_get_statement (connection, STATEMENT_RULE_DELETE, table);
+  if (stmt == NULL)
+    return EXIT_FAILURE;
 
-  return utils_run_sql ();
+  sqlite3_bind_int (stmt, 1, id);
+
+  if (utils_run_statement (connection, stmt) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  rule_index_rule_removed (connection, id, table);
+  return EXIT_SUCCESS;
+}
+
+int
+rule_delete_full (DatabaseConnection *connection,
+                  const uint16_t id,
+                  const Table table)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_DELETE);
+  int ret = delete_rule (connection, id, table);
+
+  profile_end (connection, previous);
+  return ret;
 }
 
 int
@@ -92,87 +153,370 @@ rule_enable_disable (const uint16_t id,
                      const Table table,
                      const bool active)
 {
+  return rule_enable_disable_full (NULL, id, table, active);
+}
+
+static int
+enable_disable_rule (DatabaseConnection *connection,
+                     const uint16_t id,
+                     const Table table,
+                     const bool active)
+{
+  sqlite3_stmt *stmt;
+
   if (rule_validate_table (table))
     return EXIT_FAILURE;
 
-  sqlite3_snprintf (SQL_SIZE, utils_get_sql (), "UPDATE %s SET active = %d WHERE id = %d;", TABLE[table], active, id);
+  stmt = utils_get_statement (connection, STATEMENT_RULE_ENABLE_DISABLE, table);
+  if (stmt == NULL)
+    return EXIT_FAILURE;
+
+  sqlite3_bind_int (stmt, 1, id);
+  sqlite3_bind_int (stmt, 2, active);
+
+  if (utils_run_statement (connection, stmt) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+
+  if (sqlite3_changes (sqlite3_db_handle (stmt)) > 0)
+    rule_index_rule_enabled (connection, id, table, active);
+  return EXIT_SUCCESS;
+}
+
+int
+rule_enable_disable_full (DatabaseConnection *connection,
+                          const uint16_t id,
+                          const Table table,
+                          const bool active)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_ENABLE_DISABLE);
+  int ret = enable_disable_rule (connection, id, table, active);
 
-  return utils_run_sql ();
+  profile_end (connection, previous);
+  return ret;
 }
 
 uint16_t
 rule_edit (const Rule *rule)
 {
+  return rule_edit_full (NULL, rule);
+}
+
+static uint16_t
+edit_rule (DatabaseConnection *connection,
+           const Rule         *rule)
+{
+  sqlite3_stmt *stmt;
+
   if (rule_validate_rule (rule))
     return 0;
 
-  switch (rule->table)
-    {
-    case TABLE_ON:
-      sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                        "UPDATE rules_turnon SET "\
-                        "rule_name = '%s', rule_time = '%02d:%02d:00', "\
-                        "sun = %d, mon = %d, tue = %d, wed = %d, thu = %d, fri = %d, sat = %d, "\
-                        "active = %d WHERE id = %d;",
-                        rule->name,
-                        rule->hour,
-                        rule->minutes,
-                        rule->days[0], rule->days[1], rule->days[2], rule->days[3],
-                        rule->days[4], rule->days[5], rule->days[6],
-                        rule->active,
-                        rule->id);
-      break;
-
-    case TABLE_OFF:
-      sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                        "UPDATE rules_turnoff SET "\
-                        "rule_name = '%s', rule_time = '%02d:%02d:00', "\
-                        "sun = %d, mon = %d, tue = %d, wed = %d, thu = %d, fri = %d, sat = %d, "\
-                        "active = %d, mode = %d WHERE id = %d;",
-                        rule->name,
-                        rule->hour,
-                        rule->minutes,
-                        rule->days[0], rule->days[1], rule->days[2], rule->days[3],
-                        rule->days[4], rule->days[5], rule->days[6],
-                        rule->active,
-                        rule->mode,
-                        rule->id);
-      break;
-
-    case TABLE_LAST:
-    default:
-      return 0;
-    }
+  stmt = utils_get_statement (connection, STATEMENT_RULE_EDIT, rule->table);
+  if (stmt == NULL)
+    return 0;
+
+  bind_rule (stmt, rule);
+  sqlite3_bind_int (stmt, 6, rule->id);
 
-  if (utils_run_sql () == EXIT_FAILURE)
+  if (utils_run_statement (connection, stmt) == EXIT_FAILURE)
     return 0;
 
+  // Editing a missing id changes nothing
+  if (sqlite3_changes (sqlite3_db_handle (stmt)) > 0)
+    rule_index_rule_changed (connection, rule);
+
   return rule->id;
 }
 
+uint16_t
+rule_edit_full (DatabaseConnection *connection,
+                const Rule         *rule)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_EDIT);
+  uint16_t ret = edit_rule (connection, rule);
+
+  profile_end (connection, previous);
+  return ret;
+}
+
 int
 rule_custom_schedule (const RtcwakeArgs *rtcwake_args)
+{
+  return rule_custom_schedule_full (NULL, rtcwake_args);
+}
+
+static int
+set_custom_schedule (DatabaseConnection *connection,
+                     const RtcwakeArgs  *rtcwake_args)
 {
   int ret = EXIT_FAILURE;
+  sqlite3_stmt *stmt;
+
   if (rule_validade_rtcwake_args (rtcwake_args) == -1)
     return EXIT_FAILURE;
 
-  sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                    "UPDATE custom_schedule "\
-                    "SET hour = %d, minutes = %d, "\
-                    "day = %d, month = %d, year = %d, "\
-                    "mode = %d "\
-                    "WHERE id = 1;",
-                    rtcwake_args->hour, rtcwake_args->minutes,
-                    rtcwake_args->day, rtcwake_args->month, rtcwake_args->year,
-                    rtcwake_args->mode);
+  stmt = utils_get_statement (connection, STATEMENT_CUSTOM_SCHEDULE, TABLE_LAST);
+  if (stmt == NULL)
+    return EXIT_FAILURE;
+
+  sqlite3_bind_int (stmt, 1, rtcwake_args->hour);
+  sqlite3_bind_int (stmt, 2, rtcwake_args->minutes);
+  sqlite3_bind_int (stmt, 3, rtcwake_args->day);
+  sqlite3_bind_int (stmt, 4, rtcwake_args->month);
+  sqlite3_bind_int (stmt, 5, rtcwake_args->year);
+  sqlite3_bind_int (stmt, 6, rtcwake_args->mode);
+
+  // Listeners get it as DATABASE_CHANGE_CUSTOM_SCHEDULE
+  ret = utils_run_statement (connection, stmt);
 
-  ret = utils_run_sql ();
+  return ret;
+}
 
-  // TODO
-  /* if (ret == EXIT_SUCCESS) */
-  /*   trigger_custom_schedule (); */
+int
+rule_custom_schedule_full (DatabaseConnection *connection,
+                           const RtcwakeArgs  *rtcwake_args)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_CUSTOM_SCHEDULE);
+  int ret = set_custom_schedule (connection, rtcwake_args);
 
+  profile_end (connection, previous);
   return ret;
 }
 
+RuleBatch *
+rule_batch_begin (DatabaseConnection *connection,
+                  bool                abort_on_error)
+{
+  RuleBatch *batch = calloc (1, sizeof (RuleBatch));
+
+  if (batch == NULL)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to allocate memory\n");
+      return NULL;
+    }
+
+  batch->connection = connection;
+  batch->abort_on_error = abort_on_error;
+
+  return batch;
+}
+
+static int
+batch_queue (RuleBatch          *self,
+             RuleBatchOperation  operation,
+             const Rule         *rule)
+{
+  if (self == NULL)
+    return EXIT_FAILURE;
+
+  // Grow geometrically
+  if (self->n_items == self->allocated)
+    {
+      size_t allocated = (self->allocated == 0) ? BATCH_INITIAL_ALLOC : self->allocated * 2;
+      BatchItem *items = realloc (self->items, allocated * sizeof (BatchItem));
+
+      if (items == NULL)
+        {
+          DEBUG_PRINT_CONTEX;
+          fprintf (stderr, "ERROR: Failed to allocate memory\n");
+          return EXIT_FAILURE;
+        }
+
+      self->items = items;
+      self->allocated = allocated;
+    }
+
+  self->items[self->n_items].operation = operation;
+  self->items[self->n_items].rule = *rule;
+  self->n_items++;
+
+  return EXIT_SUCCESS;
+}
+
+int
+rule_batch_add (RuleBatch  *self,
+                const Rule *rule)
+{
+  return batch_queue (self, RULE_BATCH_ADD, rule);
+}
+
+int
+rule_batch_edit (RuleBatch  *self,
+                 const Rule *rule)
+{
+  return batch_queue (self, RULE_BATCH_EDIT, rule);
+}
+
+int
+rule_batch_delete (RuleBatch      *self,
+                   const uint16_t  id,
+                   const Table     table)
+{
+  Rule rule = { .id = id, .table = table };
+  return batch_queue (self, RULE_BATCH_DELETE, &rule);
+}
+
+int
+rule_batch_enable_disable (RuleBatch      *self,
+                           const uint16_t  id,
+                           const Table     table,
+                           const bool      active)
+{
+  Rule rule = { .id = id, .table = table, .active = active };
+  return batch_queue (self, RULE_BATCH_ENABLE_DISABLE, &rule);
+}
+
+// Runs a single operation, using the same cached statements as the
+// non-batched functions; returns true on success
+static bool
+batch_run_item (DatabaseConnection *connection,
+                const BatchItem    *item,
+                uint16_t           *id)
+{
+  sqlite3 *db = connection->db;
+
+  switch (item->operation)
+    {
+    case RULE_BATCH_ADD:
+      *id = rule_add_full (connection, &item->rule);
+      return *id != 0;
+
+    // Operations on a missing id succeed in SQL, but are reported as failures
+    case RULE_BATCH_EDIT:
+      return rule_edit_full (connection, &item->rule) != 0
+             && sqlite3_changes (db) > 0;
+
+    case RULE_BATCH_DELETE:
+      return rule_delete_full (connection, item->rule.id, item->rule.table) == EXIT_SUCCESS
+             && sqlite3_changes (db) > 0;
+
+    case RULE_BATCH_ENABLE_DISABLE:
+      return rule_enable_disable_full (connection, item->rule.id,
+                                       item->rule.table, item->rule.active) == EXIT_SUCCESS
+             && sqlite3_changes (db) > 0;
+
+    default:
+      return false;
+    }
+}
+
+int
+rule_batch_commit (RuleBatch        *self,
+                   RuleBatchResult **results,
+                   size_t           *n_results)
+{
+  DatabaseConnection *connection;
+  ProfileOperation previous;
+  RuleBatchResult *items_results = NULL;
+  bool aborted = false;
+  int ret = EXIT_FAILURE;
+
+  if (results != NULL)
+    *results = NULL;
+  if (n_results != NULL)
+    *n_results = 0;
+
+  if (self == NULL)
+    return EXIT_FAILURE;
+
+  connection = utils_get_connection (self->connection);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Database not connected\n");
+      return EXIT_FAILURE;
+    }
+
+  items_results = calloc (self->n_items + 1, sizeof (RuleBatchResult));
+  if (items_results == NULL)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to allocate memory\n");
+      return EXIT_FAILURE;
+    }
+
+  for (size_t i = 0; i < self->n_items; i++)
+    {
+      items_results[i].operation = self->items[i].operation;
+      items_results[i].table = self->items[i].rule.table;
+      // Added rules only get an id once inserted
+      items_results[i].id = (self->items[i].operation == RULE_BATCH_ADD)
+                            ? 0 : self->items[i].rule.id;
+      items_results[i].status = RULE_BATCH_ITEM_ROLLED_BACK;
+    }
+
+  previous = profile_begin (connection, PROFILE_OPERATION_RULE_BATCH_COMMIT);
+
+  if (utils_run_statement (connection,
+                           utils_get_statement (connection, STATEMENT_BEGIN_IMMEDIATE, TABLE_LAST))
+      == EXIT_FAILURE)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to begin the transaction\n");
+      goto out;
+    }
+
+  for (size_t i = 0; i < self->n_items; i++)
+    {
+      if (batch_run_item (connection, &self->items[i], &items_results[i].id))
+        {
+          items_results[i].status = RULE_BATCH_ITEM_DONE;
+          continue;
+        }
+
+      items_results[i].status = RULE_BATCH_ITEM_FAILED;
+
+      // Some errors (e.g. disk full) roll back the whole transaction
+      if (self->abort_on_error || sqlite3_get_autocommit (connection->db))
+        {
+          aborted = true;
+          break;
+        }
+    }
+
+  if (!aborted
+      && utils_run_statement (connection,
+                              utils_get_statement (connection, STATEMENT_COMMIT, TABLE_LAST))
+         == EXIT_SUCCESS)
+    ret = EXIT_SUCCESS;
+  else
+    {
+      if (!sqlite3_get_autocommit (connection->db))
+        utils_run_statement (connection,
+                             utils_get_statement (connection, STATEMENT_ROLLBACK, TABLE_LAST));
+
+      for (size_t i = 0; i < self->n_items; i++)
+        {
+          if (items_results[i].status == RULE_BATCH_ITEM_DONE)
+            items_results[i].status = RULE_BATCH_ITEM_ROLLED_BACK;
+          if (items_results[i].operation == RULE_BATCH_ADD)
+            items_results[i].id = 0;
+        }
+    }
+
+out:
+  profile_end (connection, previous);
+
+  if (results != NULL && n_results != NULL)
+    {
+      *results = items_results;
+      *n_results = self->n_items;
+    }
+  else
+    free (items_results);
+
+  // The batch can be reused
+  self->n_items = 0;
+
+  return ret;
+}
+
+void
+rule_batch_finalize (RuleBatch **self)
+{
+  if (*self == NULL)
+    return;
+
+  free ((*self)->items);
+  free (*self);
+  *self = NULL;
+}
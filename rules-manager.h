@@ -21,6 +21,8 @@
 #ifndef RULES_MANAGER_H_
 #define RULES_MANAGER_H_
 
+#include <stddef.h>
+
 #include "gawake-types.h"
 
 uint16_t rule_add (const Rule *rule);
@@ -29,4 +31,58 @@ int rule_enable_disable (const uint16_t id, const Table table, const bool active
 uint16_t rule_edit (const Rule *rule);
 int rule_custom_schedule (const RtcwakeArgs *rtcwake_args);
 
+uint16_t rule_add_full (DatabaseConnection *connection, const Rule *rule);
+int rule_delete_full (DatabaseConnection *connection, const uint16_t id, const Table table);
+int rule_enable_disable_full (DatabaseConnection *connection,
+                              const uint16_t id, const Table table, const bool active);
+uint16_t rule_edit_full (DatabaseConnection *connection, const Rule *rule);
+int rule_custom_schedule_full (DatabaseConnection *connection, const RtcwakeArgs *rtcwake_args);
+
+/*
+ * Batches: operations are queued, then run by rule_batch_commit() inside a
+ * single transaction (one commit for the whole batch)
+ */
+typedef struct _RuleBatch RuleBatch;
+
+typedef enum
+{
+  RULE_BATCH_ADD,
+  RULE_BATCH_EDIT,
+  RULE_BATCH_DELETE,
+  RULE_BATCH_ENABLE_DISABLE
+} RuleBatchOperation;
+
+typedef enum
+{
+  RULE_BATCH_ITEM_DONE,
+  RULE_BATCH_ITEM_FAILED,       // invalid values, or no rule with the given id
+  RULE_BATCH_ITEM_ROLLED_BACK   // the batch was aborted; nothing was changed
+} RuleBatchItemStatus;
+
+typedef struct
+{
+  RuleBatchOperation operation;
+  Table table;
+  uint16_t id;                  // for RULE_BATCH_ADD: the id assigned to the new rule, 0 unless committed
+  RuleBatchItemStatus status;
+} RuleBatchResult;
+
+/*
+ * abort_on_error: [1] true: if any operation fails, the whole batch is rolled back
+ *                 [2] false: failed operations are reported, the others are committed
+ * Pass NULL as connection to use the default connection.
+ */
+RuleBatch *rule_batch_begin (DatabaseConnection *connection, bool abort_on_error);
+int rule_batch_add (RuleBatch *self, const Rule *rule);
+int rule_batch_edit (RuleBatch *self, const Rule *rule);
+int rule_batch_delete (RuleBatch *self, const uint16_t id, const Table table);
+int rule_batch_enable_disable (RuleBatch *self, const uint16_t id, const Table table, const bool active);
+/*
+ * Return value: EXIT_SUCCESS if the transaction was committed
+ * results: array with one result for each queued operation, in the same
+ *          order; must be freed by the caller; it may be NULL
+ */
+int rule_batch_commit (RuleBatch *self, RuleBatchResult **results, size_t *n_results);
+void rule_batch_finalize (RuleBatch **self);
+
 #endif /* RULES_MANAGER_H_ */
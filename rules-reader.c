@@ -19,6 +19,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <sqlite3.h>
 
 #include "database-connection-utils.h"
@@ -26,459 +27,609 @@
 #include "debugger.h"
 #include "rules-reader.h"
 #include "get-time.h"
+#include "rule-occurrence.h"
 
-#define ALLOC 256
-#define BUFFER_ALLOC 5
+#define RULES_INITIAL_ALLOC 16
+
+// Decodes the current row of a "SELECT * FROM <table>" statement
+static void
+read_rule (sqlite3_stmt *stmt,
+           const Table   table,
+           Rule         *rule)
+{
+  int minute_of_day;
+
+  /* ATTENTION columns numbers:
+   *    0     1             2               3       4         5
+   *    id    rule_name     rule_minute     days    active    mode
+   *                                                          ^~~~
+   *                                                             |
+   *                                         only for turn off rules
+   */
+
+  // ID
+  rule->id = (uint16_t) sqlite3_column_int (stmt, 0);
+
+  // NAME
+  snprintf (rule->name,                     // string pointer
+            RULE_NAME_LENGTH,               // size
+            "%s",                           // format
+            sqlite3_column_text (stmt, 1)); // arguments
+
+  // MINUTES AND HOUR (stored as minute of the day)
+  minute_of_day = sqlite3_column_int (stmt, 2);
+  rule->hour = (uint8_t) (minute_of_day / 60);
+  rule->minutes = (uint8_t) (minute_of_day % 60);
+
+  // DAYS (mask, bit 0: Sunday)
+  rule->days = (uint8_t) sqlite3_column_int (stmt, 3);
+
+  // ACTIVE
+  rule->active = (bool) sqlite3_column_int (stmt, 4);
+
+  // MODE (for turn on rules it isn't used, assigning 0):
+  rule->mode = (Mode) ((table == TABLE_OFF) ? sqlite3_column_int (stmt, 5) : 0);
+
+  // TABLE
+  rule->table = (Table) table;
+}
 
 int
 rule_get_single (const uint16_t id,
                  const Table table,
                  Rule *rule)
+{
+  return rule_get_single_full (NULL, id, table, rule);
+}
+
+static int
+get_single (DatabaseConnection *connection,
+            const uint16_t id,
+            const Table table,
+            Rule *rule)
 {
   // Database related variables
   int rc;
   struct sqlite3_stmt *stmt;
-  // Temporary variables to receive the hour and minutes, and then pass to the structure
-  int hour, minutes;
-  char timestamp[9]; // HH:MM:SS'\0' = 9 characters
-
 
   if (rule_validate_table (table))
     return EXIT_FAILURE;
 
-  // Generate SQL
-  // SELECT length(<table>.rule_name), * FROM <table>;
-  sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                    "SELECT * FROM %s WHERE id=%d;",
-                    TABLE[table], id);
-
-  DEBUG_PRINT (("Generated SQL:\n\t%s", utils_get_sql ()));
-
-  // Prepare statement
-  if (sqlite3_prepare_v2 (utils_get_pdb (), utils_get_sql (), -1, &stmt, NULL) != SQLITE_OK)
+  stmt = utils_get_statement (connection, STATEMENT_RULE_GET_SINGLE, table);
+  if (stmt == NULL)
     {
       DEBUG_PRINT_CONTEX;
       fprintf (stderr, "ERROR: Failed to query rule\n");
-      sqlite3_finalize (stmt);
       return EXIT_FAILURE;
     }
 
-  // Query data
-  /* ATTENTION columns numbers:
-   *    0     1             2       3       (...)       9       10        11
-   *    id    rule_name     time    sun     (...)       sat     active    mode
-   *                                                                      ^~~~
-   *                                                                         |
-   *                                                     only for turn off rules
-   */
-  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
-    {
-      // ID
-      rule->id = (uint16_t) sqlite3_column_int (stmt, 0);
-
-      // NAME
-      snprintf (rule->name,                     // string pointer
-                RULE_NAME_LENGTH,               // size
-                "%s",                           // format
-                sqlite3_column_text (stmt, 1)); // arguments
-
-      // MINUTES AND HOUR
-      sqlite3_snprintf (9, timestamp, "%s", sqlite3_column_text (stmt, 2));
-      sscanf (timestamp, "%02d:%02d", &hour, &minutes);
-      rule->hour =  (uint8_t) hour;
-      rule->minutes = (uint8_t) minutes;
-
-      // DAYS
-      for (int i = 0; i <= 6; i++)
-        {
-          // days range: [0,6]                  column range: [3,9]
-          rule->days[i] = (bool) sqlite3_column_int (stmt, (i+3));
-        }
-
-      // ACTIVE
-      rule->active = (bool) sqlite3_column_int (stmt, 10);
-
-      // MODE (for turn on rules it isn't used, assigning 0):
-      rule->mode = (Mode) ((table == TABLE_OFF) ? sqlite3_column_int (stmt, 11) : 0);
+  sqlite3_bind_int (stmt, 1, id);
 
-      // TABLE
-      rule->table = (Table) table;
-    }
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
+    read_rule (stmt, table, rule);
 
   if (rc != SQLITE_DONE)
     {
       DEBUG_PRINT_CONTEX;
       /* TODO */
-      /* fprintf (stderr, "ERROR (failed to query rule): %s\n"), sqlite3_errmsg (utils_get_pdb ()); */
-      sqlite3_finalize (stmt);
+      /* fprintf (stderr, "ERROR (failed to query rule): %s\n"), sqlite3_errmsg (sqlite3_db_handle (stmt)); */
+      sqlite3_reset (stmt);
       return EXIT_FAILURE;
     }
 
-  sqlite3_finalize(stmt);
+  sqlite3_reset (stmt);
 
   DEBUG_PRINT (("rule_get_single:\n"\
                 "\tId: %d\n"
                 "\tName: %s\n"\
                 "\tTime: %02d:%02d\n"\
-                "\tDays: [%d, %d, %d,  %d, %d, %d, %d]\n"\
+                "\tDays: 0x%02x\n"\
                 "\tActive: %d\n"\
                 "\tMode: %d\n",
                 rule->id,
                 rule->name,
                 rule->hour, rule->minutes,
-                rule->days[0], rule->days[1], rule->days[2], rule->days[3], rule->days[4], rule->days[5], rule->days[6],
+                rule->days,
                 rule->active,
                 rule->mode));
 
   return EXIT_SUCCESS;
 }
 
+int
+rule_get_single_full (DatabaseConnection *connection,
+                      const uint16_t id,
+                      const Table table,
+                      Rule *rule)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_GET_SINGLE);
+  int ret = get_single (connection, id, table, rule);
+
+  profile_end (connection, previous);
+  return ret;
+}
+
 int
 rule_get_all (const Table table,
               Rule **rules,
               uint16_t *rowcount)
 {
-  int counter = 0;
+  return rule_get_all_full (NULL, table, rules, rowcount);
+}
+
+static int
+get_all (DatabaseConnection *connection,
+         const Table table,
+         Rule **rules,
+         uint16_t *rowcount)
+{
   // Database related variables
   int rc;
   struct sqlite3_stmt *stmt;
-  // Temporary variables to receive the hour and minutes, and then pass to the structure
-  int hour, minutes;
-  char timestamp[9]; // HH:MM:SS'\0' = 9 characters
+  size_t allocated = RULES_INITIAL_ALLOC;
+  Rule *reallocated;
 
+  *rowcount = 0;
 
   if (rule_validate_table (table))
     return EXIT_FAILURE;
 
-  // Count the number of rows
-  sqlite3_snprintf (SQL_SIZE, utils_get_sql (), "SELECT COUNT(*) FROM %s;", TABLE[table]);
-  if (sqlite3_prepare_v2 (utils_get_pdb (), utils_get_sql (), -1, &stmt, NULL) == SQLITE_OK
-      && sqlite3_step (stmt) != SQLITE_ROW)
-    {
-      DEBUG_PRINT_CONTEX;
-      fprintf (stderr, "ERROR: Failed to query row count\n");
-      sqlite3_finalize (stmt);
-      return EXIT_FAILURE;
-    }
-  *rowcount = sqlite3_column_int (stmt, 0);
-
-  DEBUG_PRINT (("Row count: %d", *rowcount));
-
-  // Allocate structure array
-  // https://www.youtube.com/watch?v=lq8tJS3g6tY
-  // TODO should "sizeof (**rules)" be "sizeof (**Rules)"
-  *rules = malloc (*rowcount * sizeof (**rules));
+  // Allocate structure array; it grows geometrically while reading, so the
+  // table is scanned once, without counting the rows first
+  *rules = malloc (allocated * sizeof (**rules));
   if (*rules == NULL)
     {
       DEBUG_PRINT_CONTEX;
       fprintf (stderr, "ERROR: Failed to allocate memory\n");
-      sqlite3_finalize (stmt);
       return EXIT_FAILURE;
     }
 
-  // Generate SQL
-  // SELECT length(<table>.rule_name), * FROM <table>;
-  sqlite3_snprintf (SQL_SIZE, utils_get_sql (),
-                    "SELECT length(%s.rule_name), * FROM %s;",
-                    TABLE[table], TABLE[table]);
-
-  DEBUG_PRINT (("Generated SQL:\n\t%s", utils_get_sql ()));
-
-  // Prepare statement
-  if (sqlite3_prepare_v2 (utils_get_pdb (), utils_get_sql (), -1, &stmt, NULL) != SQLITE_OK)
+  stmt = utils_get_statement (connection, STATEMENT_RULE_GET_ALL, table);
+  if (stmt == NULL)
     {
       DEBUG_PRINT_CONTEX;
       fprintf (stderr, "ERROR: Failed to query rule\n");
       free (*rules);
-      sqlite3_finalize (stmt);
+      *rules = NULL;
       return EXIT_FAILURE;
     }
 
-  // Query data
-  /* ATTENTION columns numbers:
-   *    0                     1     2             3       4       (...)       10      11        12
-   *    rule_name length      id    rule_name     time    sun     (...)       sat     active    mode
-   *                                                                                            ^~~~
-   *                                                                                            |
-   *                                                                      only for turn off rules
-   */
   while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
     {
-      // If the loop tries to assign on non SQL_SIZEated space, leave
-      if (counter > *rowcount)
-        break;
-
-      // ID
-      (*rules)[counter].id = (uint16_t) sqlite3_column_int (stmt, 1);
-
-      // NAME
-      snprintf ((*rules)[counter].name,           // string pointer
-                  RULE_NAME_LENGTH,               // size
-                  "%s",                           // format
-                  sqlite3_column_text (stmt, 2)   // arguments
-                  );
-
-      // MINUTES AND HOUR
-      sqlite3_snprintf (9, timestamp, "%s", sqlite3_column_text (stmt, 3));
-      sscanf (timestamp, "%02d:%02d", &hour, &minutes);
-      (*rules)[counter].hour =  (uint8_t) hour;
-      (*rules)[counter].minutes = (uint8_t) minutes;
-
-      // DAYS
-      for (int i = 0; i <= 6; i++)
+      // rowcount can't represent more rules
+      if (*rowcount == UINT16_MAX)
         {
-          // days range: [0,6]                  column range: [4,10]
-          (*rules)[counter].days[i] = (bool) sqlite3_column_int (stmt, (i+4));
+          rc = SQLITE_DONE;
+          break;
         }
 
-      // ACTIVE
-      (*rules)[counter].active = (bool) sqlite3_column_int (stmt, 11);
-
-      // MODE (for turn on rules it isn't used, assigning 0):
-      (*rules)[counter].mode = (Mode) ((table == TABLE_OFF) ? sqlite3_column_int (stmt, 12) : 0);
-
-      // TABLE
-      (*rules)[counter].table = (Table) table;
+      if (*rowcount == allocated)
+        {
+          reallocated = realloc (*rules, 2 * allocated * sizeof (**rules));
+          if (reallocated == NULL)
+            {
+              DEBUG_PRINT_CONTEX;
+              fprintf (stderr, "ERROR: Failed to allocate memory\n");
+              break;
+            }
+          *rules = reallocated;
+          allocated *= 2;
+        }
 
-      counter++;
+      read_rule (stmt, table, &(*rules)[*rowcount]);
+      (*rowcount)++;
     }
 
   if (rc != SQLITE_DONE)
     {
       DEBUG_PRINT_CONTEX;
       /* TODO */
-      /* fprintf (stderr, "ERROR (failed to query rule): %s\n"), sqlite3_errmsg (utils_get_pdb ()); */
+      /* fprintf (stderr, "ERROR (failed to query rule): %s\n"), sqlite3_errmsg (sqlite3_db_handle (stmt)); */
       free (*rules);
-      sqlite3_finalize (stmt);
+      *rules = NULL;
+      *rowcount = 0;
+      sqlite3_reset (stmt);
       return EXIT_FAILURE;
     }
 
-  sqlite3_finalize(stmt);
+  sqlite3_reset (stmt);
+
+  DEBUG_PRINT (("Row count: %d", *rowcount));
 
   return EXIT_SUCCESS;
 }
 
-// Receives a week day from 0 to 13, and returns from 0 to 6 (Sunday to Saturday);
-// in other words, two weeks must be represented from 0 to 6 instead of 0 to 13
-static int
-week_day (int num)
+int
+rule_get_all_full (DatabaseConnection *connection,
+                   const Table table,
+                   Rule **rules,
+                   uint16_t *rowcount)
 {
-  switch (num)
-  {
-  case 0:
-  case 7:
-    return 0;
-
-  case 1:
-  case 8:
-    return 1;
-
-  case 2:
-  case 9:
-    return 2;
-
-  case 3:
-  case 10:
-    return 3;
-
-  case 4:
-  case 11:
-    return 4;
-
-  case 5:
-  case 12:
-    return 5;
-
-  case 6:
-  case 13:
-    return 6;
-
-  default:
-    return -1;
-  }
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_GET_ALL);
+  int ret = get_all (connection, table, rules, rowcount);
+
+  profile_end (connection, previous);
+  return ret;
 }
 
-RtcwakeArgsReturn
-rule_get_upcoming_on (RtcwakeArgs *rtcwake_args,
-                      Mode         mode)
+static int
+get_all_into (DatabaseConnection *connection,
+              const Table table,
+              Rule *rules,
+              const uint16_t capacity,
+              uint16_t *rowcount,
+              bool *truncated)
 {
-  int rc, now, ruletime, id_match = -1;
-  bool is_localtime = true;
-
-  struct tm *timeinfo;
+  // Database related variables
+  int rc = SQLITE_DONE;
   struct sqlite3_stmt *stmt;
 
-  // Index(0 to 6) matches tm_wday; these strings refer to SQLite columns name
-  char query[ALLOC], buffer[BUFFER_ALLOC], date[9];
+  *rowcount = 0;
 
-  rtcwake_args->found = false;
+  if (rule_validate_table (table))
+    return EXIT_FAILURE;
 
-  // GET THE DATABASE CONFIG
-  rc = sqlite3_prepare_v2 (utils_get_pdb (),
-                           "SELECT localtime, default_mode, shutdown_fail "\
-                           "FROM config WHERE id = 1;",
-                           -1,
-                           &stmt,
-                           NULL);
-  if (rc != SQLITE_OK)
+  stmt = utils_get_statement (connection, STATEMENT_RULE_GET_ALL, table);
+  if (stmt == NULL)
     {
       DEBUG_PRINT_CONTEX;
-      fprintf (stderr, "ERROR: Failed getting config information\n");
-      return RTCWAKE_ARGS_RETURN_FAILURE;
+      fprintf (stderr, "ERROR: Failed to query rule\n");
+      return EXIT_FAILURE;
     }
-  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
+
+  while (*rowcount < capacity && (rc = sqlite3_step (stmt)) == SQLITE_ROW)
     {
-      // Localtime
-      is_localtime = (bool) sqlite3_column_int (stmt, 0);
-
-      // Mode
-      // Use default mode
-      if (mode == MODE_LAST)
-        rtcwake_args->mode = (Mode) sqlite3_column_int (stmt, 1);
-      // Use passed mode
-      else
-        rtcwake_args->mode = mode;
-
-      // Shutdown on failure
-      rtcwake_args->shutdown_fail = sqlite3_column_int (stmt, 2);
+      read_rule (stmt, table, &rules[*rowcount]);
+      (*rowcount)++;
     }
-  if (rc != SQLITE_DONE)
+
+  // A full buffer: one more step tells if rules were left out
+  if (*rowcount == capacity)
+    rc = sqlite3_step (stmt);
+
+  sqlite3_reset (stmt);
+
+  if (rc != SQLITE_DONE && rc != SQLITE_ROW)
     {
       DEBUG_PRINT_CONTEX;
-      fprintf (stderr, "ERROR (failed getting config information): %s\n",
-               sqlite3_errmsg (utils_get_pdb ()));
-      return RTCWAKE_ARGS_RETURN_FAILURE;
+      fprintf (stderr, "ERROR: Failed to query rules\n");
+      return EXIT_FAILURE;
     }
-  sqlite3_finalize (stmt);
 
-  // GET THE CURRENT TIME
-  // hour, minutes and seconds as integer members
-  get_time_tm (&timeinfo);
-  // Concatenate: HHMM as a string
-  snprintf (buffer, BUFFER_ALLOC, "%02d%02d", timeinfo->tm_hour, timeinfo->tm_min);
-  // HHMM as an integer, leading zeros doesn't matter
-  now = atoi (buffer);
-
-  DEBUG_PRINT (("Trying to get schedule for today\n"));
-
-  // Create an SQL statement to get today's active rules time; tm_wday = number of the week
-  snprintf (query,
-            ALLOC,
-            "SELECT id, strftime('%%H%%M', rule_time), strftime('%%Y%%m%%d', 'now', '%s') "\
-            "FROM rules_turnon "\
-            "WHERE %s = 1 AND active = 1 "\
-            "ORDER BY time(rule_time) ASC;",
-            is_localtime ? "localtime" : "utc",
-            DAYS[timeinfo->tm_wday]);
-
-  rc = sqlite3_prepare_v2 (utils_get_pdb (), query, -1, &stmt, NULL);
-  if (rc != SQLITE_OK)
+  if (truncated != NULL)
+    *truncated = (rc == SQLITE_ROW);
+
+  return EXIT_SUCCESS;
+}
+
+int
+rule_get_all_into (DatabaseConnection *connection,
+                   const Table table,
+                   Rule *rules,
+                   const uint16_t capacity,
+                   uint16_t *rowcount,
+                   bool *truncated)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_GET_ALL);
+  int ret = get_all_into (connection, table, rules, capacity, rowcount, truncated);
+
+  profile_end (connection, previous);
+  return ret;
+}
+
+static int
+foreach (DatabaseConnection *connection,
+         const Table table,
+         const RuleFilter *filter,
+         RuleForeachFunc func,
+         void *user_data)
+{
+  // Database related variables
+  int rc;
+  struct sqlite3_stmt *stmt;
+  // Each row is decoded in the same buffer
+  Rule rule;
+
+  if (rule_validate_table (table))
+    return EXIT_FAILURE;
+
+  stmt = utils_get_statement (connection, STATEMENT_RULE_FOREACH, table);
+  if (stmt == NULL)
     {
       DEBUG_PRINT_CONTEX;
-      fprintf (stderr, "ERROR: Failed while querying rules to make schedule for today\n");
-      return RTCWAKE_ARGS_RETURN_FAILURE;
+      fprintf (stderr, "ERROR: Failed to query rules\n");
+      return EXIT_FAILURE;
     }
 
-  // Get all rules today, ordered by time; the first rule that has a bigger time than now is a valid
+  sqlite3_bind_int (stmt, 1, (filter != NULL) ? filter->active_only : false);
+  sqlite3_bind_int (stmt, 2, (filter != NULL) ? filter->days : 0);
+
   while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
     {
-      int id = sqlite3_column_int (stmt, 0);
-      ruletime = sqlite3_column_int (stmt, 1);
-      if (now < ruletime)
+      read_rule (stmt, table, &rule);
+
+      if (!func (&rule, user_data))
         {
-          id_match = id;
-          snprintf (date, 9, "%s", sqlite3_column_text (stmt, 2));               // YYYYMMDD
-          snprintf (buffer, BUFFER_ALLOC, "%s", sqlite3_column_text (stmt, 1));  // HHMM
+          rc = SQLITE_DONE;
           break;
         }
-      }
-    if (rc != SQLITE_DONE && rc != SQLITE_ROW)
-      {
-        DEBUG_PRINT_CONTEX;
-        fprintf (stderr, "ERROR (failed scheduling for today): %s\n",
-                 sqlite3_errmsg (utils_get_pdb ()));
-        return RTCWAKE_ARGS_RETURN_FAILURE;
-      }
-  sqlite3_finalize (stmt);
-
-  // IF IT WASN'T POSSIBLE TO SCHEDULE FOR TODAY, TRY ON THE NEXT DAYS
-  if (id_match < 0)
+    }
+
+  sqlite3_reset (stmt);
+
+  if (rc != SQLITE_DONE)
     {
-      DEBUG_PRINT (("Any time matched. Trying to schedule for tomorrow or later\n"));
-      // search for a matching rule within a week
-      for (int i = 1; i <= 7; i++)
-        {
-          int wday_num = week_day (timeinfo->tm_wday + i);
-          if (wday_num == -1)
-            {
-              DEBUG_PRINT_CONTEX;
-              fprintf (stderr, "ERROR: Failed to get schedule for for tomorrow or later (on wday function)\n");
-              return RTCWAKE_ARGS_RETURN_FAILURE;
-            }
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to query rules\n");
+      return EXIT_FAILURE;
+    }
 
-          /*
-           * The first rule after today is a valid match;
-           * also calculate the day: now + number of day until the matching rule,
-           * represented by the index i of the loop
-           */
-          snprintf (query,
-                    ALLOC,
-                    "SELECT id, strftime('%%Y%%m%%d', 'now', '%s', '+%d day'), strftime('%%H%%M', rule_time) "\
-                    "FROM rules_turnon "\
-                    "WHERE %s = 1 AND active = 1 "\
-                    "ORDER BY time(rule_time) ASC LIMIT 1;",
-                    is_localtime ? "localtime" : "utc",
-                    i,
-                    DAYS[wday_num]);
-
-          rc = sqlite3_prepare_v2 (utils_get_pdb (), query, -1, &stmt, NULL);
-          if (rc != SQLITE_OK)
-            {
-              DEBUG_PRINT_CONTEX;
-              fprintf (stderr, "ERROR: Failed scheduling for after\n");
-              return RTCWAKE_ARGS_RETURN_FAILURE;
-            }
-          while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
-            {
-              id_match = sqlite3_column_int (stmt, 0);
-              snprintf (date, 9, "%s", sqlite3_column_text (stmt, 1)); // YYYYMMDD
-              snprintf (buffer,
-                        BUFFER_ALLOC,
-                        "%s",
-                        sqlite3_column_text (stmt, 2)); // HHMM
-            }
-          if (rc != SQLITE_DONE)
-            {
-              DEBUG_PRINT_CONTEX;
-              fprintf (stderr, "ERROR (failed scheduling for after): %s\n",
-                       sqlite3_errmsg (utils_get_pdb ()));
-              return RTCWAKE_ARGS_RETURN_FAILURE;
-            }
-          sqlite3_finalize (stmt);
+  return EXIT_SUCCESS;
+}
+
+int
+rule_foreach (DatabaseConnection *connection,
+              const Table table,
+              const RuleFilter *filter,
+              RuleForeachFunc func,
+              void *user_data)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_FOREACH);
+  int ret = foreach (connection, table, filter, func, user_data);
+
+  profile_end (connection, previous);
+  return ret;
+}
+
+static int
+run_query (DatabaseConnection *connection,
+           const Table table,
+           const RuleQuery *query,
+           RuleCursor *cursor,
+           Rule *rules,
+           const uint16_t capacity,
+           uint16_t *rowcount)
+{
+  // Bigger than any text, see RULE_QUERY
+  static const unsigned char NAME_MAX_BOUND[] = { 0xFF };
+  int rc;
+  size_t prefix_length = 0;
+  char *name_bound = NULL;
+  struct sqlite3_stmt *stmt;
+
+  *rowcount = 0;
+
+  if (rule_validate_table (table))
+    return EXIT_FAILURE;
+
+  if (query->order < 0 || query->order >= RULE_ORDER_LAST
+      || (query->time_range && (query->minute_from > query->minute_to || query->minute_to > 1439)))
+    {
+      fprintf (stderr, "Invalid rule query\n");
+      return EXIT_FAILURE;
+    }
+
+  if (!cursor->started && query->order == RULE_ORDER_NEXT_FIRE)
+    {
+      struct tm timeinfo;
+
+      if (get_time_tm_r (&timeinfo) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+      cursor->now = timeinfo.tm_wday * 1440 + timeinfo.tm_hour * 60 + timeinfo.tm_min;
+    }
 
-          if (id_match >= 0)
-            break;
+  /*
+   * Names starting with the prefix are those in [prefix, bound), where the
+   * bound is the prefix with its last byte incremented (after dropping
+   * trailing 0xFF bytes, which can't be incremented)
+   */
+  if (query->name_prefix != NULL)
+    {
+      prefix_length = strlen (query->name_prefix);
+      name_bound = strdup (query->name_prefix);
+      if (name_bound == NULL)
+        {
+          DEBUG_PRINT_CONTEX;
+          fprintf (stderr, "ERROR: Failed to allocate memory\n");
+          return EXIT_FAILURE;
         }
     }
 
+  stmt = utils_get_statement (connection, STATEMENT_RULE_QUERY_ID + query->order, table);
+  if (stmt == NULL)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to query rules\n");
+      free (name_bound);
+      return EXIT_FAILURE;
+    }
+
+  sqlite3_bind_int (stmt, 1, query->filter.active_only);
+  sqlite3_bind_int (stmt, 2, query->filter.days);
+  sqlite3_bind_int (stmt, 3, query->time_range ? query->minute_from : 0);
+  sqlite3_bind_int (stmt, 4, query->time_range ? query->minute_to : 1439);
+
+  sqlite3_bind_text (stmt, 5, (name_bound != NULL) ? query->name_prefix : "", -1, SQLITE_STATIC);
+  while (prefix_length > 0 && (unsigned char) name_bound[prefix_length - 1] == 0xFF)
+    prefix_length--;
+  if (prefix_length > 0)
+    {
+      name_bound[prefix_length - 1]++;
+      sqlite3_bind_text (stmt, 6, name_bound, (int) prefix_length, SQLITE_STATIC);
+    }
+  else
+    sqlite3_bind_blob (stmt, 6, NAME_MAX_BOUND, sizeof (NAME_MAX_BOUND), SQLITE_STATIC);
+
+  // Every sort key is >= 0
+  sqlite3_bind_int (stmt, 7, cursor->started ? cursor->key : -1);
+  sqlite3_bind_int (stmt, 8, cursor->started ? cursor->id : 0);
+  sqlite3_bind_int (stmt, 9, cursor->now);
+  sqlite3_bind_int (stmt, 10, capacity);
+
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      read_rule (stmt, table, &rules[*rowcount]);
+      (*rowcount)++;
+
+      cursor->started = true;
+      cursor->key = sqlite3_column_int (stmt, sqlite3_column_count (stmt) - 1);
+      cursor->id = rules[*rowcount - 1].id;
+    }
+
+  sqlite3_reset (stmt);
+  free (name_bound);
+
+  if (rc != SQLITE_DONE)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed to query rules\n");
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+int
+rule_query (DatabaseConnection *connection,
+            const Table table,
+            const RuleQuery *query,
+            RuleCursor *cursor,
+            Rule *rules,
+            const uint16_t capacity,
+            uint16_t *rowcount)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_QUERY);
+  int ret = run_query (connection, table, query, cursor, rules, capacity, rowcount);
+
+  profile_end (connection, previous);
+  return ret;
+}
+
+/*
+ * Finds the earliest occurrence of the active rules within a week from
+ * "now_minute" (of the week, local time) in the rules index; ties go to the
+ * lowest id. *offset is in days from now.
+ * *id is set to -1 if there isn't any active rule; *mode is only set for
+ * turn off rules.
+ */
+static int
+find_upcoming (DatabaseConnection *connection,
+               const Table         table,
+               const int           now_minute,
+               int                *id,
+               int                *offset,
+               int                *minute,
+               Mode               *mode)
+{
+  int later;
+  RuleIndexEntry entry;
+  bool found;
+
+  *id = -1;
+
+  if (rule_index_next (connection, table, now_minute, &entry, &found) == EXIT_FAILURE)
+    {
+      DEBUG_PRINT_CONTEX;
+      fprintf (stderr, "ERROR: Failed while querying rules to make schedule\n");
+      return EXIT_FAILURE;
+    }
+
+  if (!found)
+    return EXIT_SUCCESS;
+
+  // Minutes from the start of this week; (0, MINUTES_PER_WEEK] after now
+  later = entry.minute;
+  if (later <= now_minute)
+    later += MINUTES_PER_WEEK;
+
+  *id = entry.id;
+  *offset = later / 1440 - now_minute / 1440;
+  *minute = later % 1440;
+  if (table == TABLE_OFF)
+    *mode = (Mode) entry.mode;
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Shared by the turn on and turn off lookups: "mode" is the mode to use
+ * for turn on rules (MODE_LAST: the default one); turn off rules use their
+ * own mode, falling back to the default one if it is MODE_LAST
+ */
+static RtcwakeArgsReturn
+get_upcoming (DatabaseConnection *connection,
+              const Table         table,
+              RtcwakeArgs        *rtcwake_args,
+              Mode                mode,
+              int                *id_match)
+{
+  int ruletime = 0, offset = 0, now_minute;
+  int64_t today;
+  Config config;
+  Occurrence occurrence;
+  time_t now;
+
+  *id_match = -1;
+  rtcwake_args->found = false;
+
+  connection = utils_get_connection (connection);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Database not connected\n");
+      return RTCWAKE_ARGS_RETURN_FAILURE;
+    }
+
+  // GET THE DATABASE CONFIG
+  if (configuration_get_all (connection, &config) == EXIT_FAILURE)
+    return RTCWAKE_ARGS_RETURN_FAILURE;
+  rtcwake_args->shutdown_fail = config.shutdown_fail;
+
+  // GET THE CURRENT TIME
+  if (get_time (&now) == EXIT_FAILURE)
+    return RTCWAKE_ARGS_RETURN_FAILURE;
+  // Everything below derives from this single instant
+  tz_offsets_check_zone (&connection->tz_offsets);
+  if (occurrence_local (&connection->tz_offsets, now, &today, &now_minute) == EXIT_FAILURE)
+    return RTCWAKE_ARGS_RETURN_FAILURE;
+  now_minute += occurrence_weekday (today) * 1440;
+
+  // FIND THE EARLIEST RULE WITHIN A WEEK
+  if (find_upcoming (connection, table, now_minute, id_match, &offset, &ruletime, &mode))
+    return RTCWAKE_ARGS_RETURN_FAILURE;
+
   // IF ANY RULE WAS FOUND, SEND RETURN AS RULE NOT FOUND
-  if (id_match < 0)
+  if (*id_match < 0)
     {
-      fprintf (stderr, "WARNING: Any turn on rule found.\n");
+      fprintf (stderr, "WARNING: Any %s rule found.\n",
+               (table == TABLE_ON) ? "turn on" : "turn off");
       return RTCWAKE_ARGS_RETURN_NOT_FOUND;
     }
 
   // ELSE, RETURN PARAMETERS
   rtcwake_args->found = true;
+  rtcwake_args->mode = (mode == MODE_LAST) ? config.default_mode : mode;
 
-  sscanf (buffer, "%02d%02d",
-          &(rtcwake_args->hour),
-          &(rtcwake_args->minutes));
+  if (occurrence_at (&connection->tz_offsets, today + offset, ruletime, &occurrence) == EXIT_FAILURE)
+    return RTCWAKE_ARGS_RETURN_FAILURE;
+  rtcwake_args->epoch = occurrence.epoch;
 
-  sscanf (date, "%04d%02d%02d",
-          &(rtcwake_args->year),
-          &(rtcwake_args->month),
-          &(rtcwake_args->day));
+  if (config.use_localtime)
+    {
+      // Where a DST change skipped the rule time, the time it's moved to
+      rtcwake_args->hour = occurrence.hour;
+      rtcwake_args->minutes = occurrence.minutes;
+      rtcwake_args->day = occurrence.day;
+      rtcwake_args->month = occurrence.month;
+      rtcwake_args->year = occurrence.year;
+    }
+  else
+    {
+      // The RTC date is UTC
+      rtcwake_args->hour = ruletime / 60;
+      rtcwake_args->minutes = ruletime % 60;
+      occurrence_date_from_days (now / 86400 + offset, &rtcwake_args->year,
+                                 &rtcwake_args->month, &rtcwake_args->day);
+    }
 
   DEBUG_PRINT (("RtcwakeArgs fields:\n"\
                 "\tFound: %d\n\tShutdown: %d"\
@@ -489,8 +640,223 @@ rule_get_upcoming_on (RtcwakeArgs *rtcwake_args,
                 rtcwake_args->day, rtcwake_args->month, rtcwake_args->year,
                 rtcwake_args->mode));
 
-  if (rule_validade_rtcwake_args (rtcwake_args) == EXIT_FAILURE)
+  if (rule_validade_rtcwake_args_at (rtcwake_args, now) == EXIT_FAILURE)
     return RTCWAKE_ARGS_RETURN_INVALID;
   else
     return RTCWAKE_ARGS_RETURN_SUCESS;
 }
+
+RtcwakeArgsReturn
+rule_get_upcoming_on (RtcwakeArgs *rtcwake_args,
+                      Mode         mode)
+{
+  return rule_get_upcoming_on_full (NULL, rtcwake_args, mode);
+}
+
+RtcwakeArgsReturn
+rule_get_upcoming_on_full (DatabaseConnection *connection,
+                           RtcwakeArgs        *rtcwake_args,
+                           Mode                mode)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_GET_UPCOMING_ON);
+  RtcwakeArgsReturn ret;
+  int id;
+
+  ret = get_upcoming (connection, TABLE_ON, rtcwake_args, mode, &id);
+
+  profile_end (connection, previous);
+  return ret;
+}
+
+RtcwakeArgsReturn
+rule_get_upcoming_off (RtcwakeArgs *rtcwake_args,
+                       uint16_t    *id)
+{
+  return rule_get_upcoming_off_full (NULL, rtcwake_args, id);
+}
+
+RtcwakeArgsReturn
+rule_get_upcoming_off_full (DatabaseConnection *connection,
+                            RtcwakeArgs        *rtcwake_args,
+                            uint16_t           *id)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_GET_UPCOMING_OFF);
+  RtcwakeArgsReturn ret;
+  int id_match;
+
+  ret = get_upcoming (connection, TABLE_OFF, rtcwake_args, MODE_LAST, &id_match);
+  profile_end (connection, previous);
+
+  if (id != NULL)
+    *id = (id_match > 0) ? (uint16_t) id_match : 0;
+
+  return ret;
+}
+
+// Occurrences of a table's rules in time order: a cursor over its index,
+// moving to the next week when it wraps
+typedef struct
+{
+  const RuleIndex *index;
+  Table table;
+  size_t pos;
+  int week;
+} EventStream;
+
+static int
+event_stream_key (const EventStream *stream)
+{
+  return stream->week * MINUTES_PER_WEEK + stream->index->entries[stream->pos].minute;
+}
+
+static void
+event_stream_next (EventStream *stream)
+{
+  if (++stream->pos == stream->index->n_entries)
+    {
+      stream->pos = 0;
+      stream->week++;
+    }
+}
+
+static int
+get_upcoming_events (DatabaseConnection *connection,
+                     const time_t        from,
+                     const time_t        until,
+                     const size_t        max_events,
+                     RuleEvent         **events,
+                     size_t             *n_events)
+{
+  EventStream streams[TABLE_LAST];
+  int n_streams = 0, now_minute;
+  int64_t week_start;
+  Config config;
+  RuleEvent *result = NULL;
+  size_t count = 0, allocated = 0;
+
+  *events = NULL;
+  *n_events = 0;
+
+  if (until == 0 && max_events == 0)
+    {
+      fprintf (stderr, "ERROR: Upcoming events need a horizon or a maximum count\n");
+      return EXIT_FAILURE;
+    }
+
+  connection = utils_get_connection (connection);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Database not connected\n");
+      return EXIT_FAILURE;
+    }
+
+  if (configuration_get_all (connection, &config) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+  tz_offsets_check_zone (&connection->tz_offsets);
+
+  // Minutes are counted from the Sunday 00:00 of the week of "from"
+  if (occurrence_local (&connection->tz_offsets, from, &week_start, &now_minute) == EXIT_FAILURE)
+    return EXIT_FAILURE;
+  now_minute += occurrence_weekday (week_start) * 1440;
+  week_start -= occurrence_weekday (week_start);
+
+  for (int t = 0; t < TABLE_LAST; t++)
+    {
+      const RuleIndex *index = rule_index_get (connection, (Table) t);
+
+      if (index == NULL)
+        return EXIT_FAILURE;
+      if (index->n_entries == 0)
+        continue;
+
+      streams[n_streams] = (EventStream) {
+        .index = index,
+        .table = (Table) t,
+        .pos = rule_index_after (index, now_minute),
+        .week = 0,
+      };
+      if (streams[n_streams].pos == index->n_entries)
+        {
+          streams[n_streams].pos = 0;
+          streams[n_streams].week = 1;
+        }
+      n_streams++;
+    }
+
+  // Merge the streams, taking the earliest occurrence each time
+  while (n_streams > 0 && (max_events == 0 || count < max_events))
+    {
+      EventStream *earliest = &streams[0];
+      const RuleIndexEntry *entry;
+      Occurrence fire;
+      int key;
+
+      for (int s = 1; s < n_streams; s++)
+        {
+          if (event_stream_key (&streams[s]) < event_stream_key (earliest))
+            earliest = &streams[s];
+        }
+
+      key = event_stream_key (earliest);
+      entry = &earliest->index->entries[earliest->pos];
+
+      if (occurrence_at (&connection->tz_offsets, week_start + key / 1440, key % 1440,
+                         &fire) == EXIT_FAILURE)
+        {
+          free (result);
+          return EXIT_FAILURE;
+        }
+
+      if (count == allocated)
+        {
+          RuleEvent *tmp;
+
+          allocated = (allocated > 0) ? allocated * 2
+                      : (max_events > 0 && max_events < RULES_INITIAL_ALLOC) ? max_events
+                      : RULES_INITIAL_ALLOC;
+          tmp = realloc (result, allocated * sizeof (RuleEvent));
+          if (tmp == NULL)
+            {
+              DEBUG_PRINT_CONTEX;
+              fprintf (stderr, "ERROR: Failed to allocate memory\n");
+              free (result);
+              return EXIT_FAILURE;
+            }
+          result = tmp;
+        }
+
+      result[count] = (RuleEvent) {
+        .timestamp = fire.epoch,
+        .table = earliest->table,
+        .id = entry->id,
+        .mode = (earliest->table == TABLE_OFF && entry->mode != MODE_LAST)
+                ? (Mode) entry->mode : config.default_mode,
+      };
+
+      if (until != 0 && result[count].timestamp > until)
+        break;
+
+      count++;
+      event_stream_next (earliest);
+    }
+
+  *events = result;
+  *n_events = count;
+
+  return EXIT_SUCCESS;
+}
+
+int
+rule_get_upcoming_events (DatabaseConnection *connection,
+                          const time_t        from,
+                          const time_t        until,
+                          const size_t        max_events,
+                          RuleEvent         **events,
+                          size_t             *n_events)
+{
+  ProfileOperation previous = profile_begin (connection, PROFILE_OPERATION_RULE_GET_UPCOMING_EVENTS);
+  int ret = get_upcoming_events (connection, from, until, max_events, events, n_events);
+
+  profile_end (connection, previous);
+  return ret;
+}
@@ -21,19 +21,141 @@
 #ifndef RULES_READER_H_
 #define RULES_READER_H_
 
+#include <stddef.h>
+#include <time.h>
+
 #include "gawake-types.h"
 
 // TODO make const pointers
 int rule_get_single (const uint16_t id,
                      const Table table,
                      Rule *rule);
+int rule_get_single_full (DatabaseConnection *connection,
+                          const uint16_t id,
+                          const Table table,
+                          Rule *rule);
 
 int rule_get_all (const Table table,
                   Rule **rules,
                   uint16_t *rowcount);
+int rule_get_all_full (DatabaseConnection *connection,
+                       const Table table,
+                       Rule **rules,
+                       uint16_t *rowcount);
+/*
+ * Reads at most "capacity" rules into a caller-supplied array, without
+ * allocating; *truncated (may be NULL) tells if the table has more rules
+ * than fit
+ */
+int rule_get_all_into (DatabaseConnection *connection,
+                       const Table table,
+                       Rule *rules,
+                       const uint16_t capacity,
+                       uint16_t *rowcount,
+                       bool *truncated);
+
+// Optional filters of rule_foreach(), applied by SQLite
+typedef struct
+{
+  bool active_only;
+  uint8_t days;       // only rules set on any of these days (bit 0: Sunday, ..., bit 6: Saturday); 0: any
+} RuleFilter;
+
+typedef enum
+{
+  RULE_ORDER_ID,
+  RULE_ORDER_TIME,          // time of the day
+  RULE_ORDER_NEXT_FIRE,     // next occurrence from now; rules without days come last
+  RULE_ORDER_LAST
+} RuleOrder;
+
+typedef struct
+{
+  RuleFilter filter;
+  bool time_range;          // only rules from minute_from to minute_to (of the day)
+  uint16_t minute_from;
+  uint16_t minute_to;
+  const char *name_prefix;  // NULL: any name
+  RuleOrder order;
+} RuleQuery;
+
+// Where a query stopped; zero it to get the first page
+typedef struct
+{
+  bool started;
+  int now;                  // RULE_ORDER_NEXT_FIRE: minute of the week of the first page
+  int key;
+  uint16_t id;
+} RuleCursor;
+
+/*
+ * Reads a page of at most "capacity" rules matching the query, continuing
+ * from the cursor, which is then moved after the last rule read. The last
+ * page has *rowcount < capacity. Filtering, ordering and paging happen in
+ * SQLite, so only the page is read.
+ */
+int rule_query (DatabaseConnection *connection,
+                const Table table,
+                const RuleQuery *query,
+                RuleCursor *cursor,
+                Rule *rules,
+                const uint16_t capacity,
+                uint16_t *rowcount);
+
+// Return false to stop iterating; the rule is only valid during the call
+typedef bool (*RuleForeachFunc) (const Rule *rule,
+                                 void       *user_data);
+
+/*
+ * Calls "func" for each rule of the table matching the filter (NULL: all
+ * rules), one at a time, without allocating memory. "func" may read the
+ * database through the same connection, except rule_foreach() on the same
+ * table, which fails while this one runs.
+ * Pass NULL as connection to use the default connection.
+ */
+int rule_foreach (DatabaseConnection *connection,
+                  const Table table,
+                  const RuleFilter *filter,
+                  RuleForeachFunc func,
+                  void *user_data);
 
 // Mode: pass MODE_LAST to use the default mode
 RtcwakeArgsReturn rule_get_upcoming_on (RtcwakeArgs *rtcwake_args,
                                         Mode         mode);
+RtcwakeArgsReturn rule_get_upcoming_on_full (DatabaseConnection *connection,
+                                             RtcwakeArgs        *rtcwake_args,
+                                             Mode                mode);
+
+/*
+ * Next active turn off rule, with its own mode, or the default mode if the
+ * rule mode is MODE_LAST; "id" (may be NULL) receives the rule id, 0 if
+ * none was found
+ */
+RtcwakeArgsReturn rule_get_upcoming_off (RtcwakeArgs *rtcwake_args,
+                                         uint16_t    *id);
+RtcwakeArgsReturn rule_get_upcoming_off_full (DatabaseConnection *connection,
+                                              RtcwakeArgs        *rtcwake_args,
+                                              uint16_t           *id);
+
+// A single firing of a rule
+typedef struct
+{
+  time_t timestamp;
+  Table table;
+  uint16_t id;
+  Mode mode;      // turn off rules: the rule mode, or the default one; turn on rules: the default one
+} RuleEvent;
+
+/*
+ * Upcoming events of both tables after "from", in time order (ties by
+ * table, then id), up to "until" and/or "max_events" (0: no limit, but
+ * one of them must be set). The array must be freed by the caller.
+ */
+int rule_get_upcoming_events (DatabaseConnection *connection,
+                              const time_t        from,
+                              const time_t        until,
+                              const size_t        max_events,
+                              RuleEvent         **events,
+                              size_t             *n_events);
 
 #endif /* RULES_READER_H_ */
@@ -0,0 +1,183 @@
+/* test-batch.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <sqlite3.h>
+
+#include "test-common.h"
+
+static uint16_t
+count_rules (DatabaseConnection *connection,
+             const Table         table)
+{
+  Rule *rules;
+  uint16_t rowcount;
+
+  TEST_ASSERT (rule_get_all_full (connection, table, &rules, &rowcount) == EXIT_SUCCESS);
+  free (rules);
+
+  return rowcount;
+}
+
+// Everything is committed, and added rules get their ids
+static void
+test_commit (DatabaseConnection *connection)
+{
+  RuleBatch *batch = rule_batch_begin (connection, true);
+  RuleBatchResult *results;
+  size_t n_results;
+  Rule first = test_rule (TABLE_ON, 6, 0, DAYS_ALL);
+  Rule second = test_rule (TABLE_OFF, 23, 0, DAYS_ALL);
+  Rule read;
+
+  TEST_ASSERT (rule_batch_add (batch, &first) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_batch_add (batch, &second) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_batch_commit (batch, &results, &n_results) == EXIT_SUCCESS);
+
+  TEST_ASSERT (n_results == 2);
+  for (size_t i = 0; i < n_results; i++)
+    {
+      TEST_ASSERT (results[i].status == RULE_BATCH_ITEM_DONE);
+      TEST_ASSERT (results[i].id != 0);
+    }
+
+  // The batch is reused: edit, disable and delete what was added
+  first.id = results[0].id;
+  first.hour = 7;
+  TEST_ASSERT (rule_batch_edit (batch, &first) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_batch_enable_disable (batch, first.id, TABLE_ON, false) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_batch_delete (batch, results[1].id, TABLE_OFF) == EXIT_SUCCESS);
+  free (results);
+
+  TEST_ASSERT (rule_batch_commit (batch, &results, &n_results) == EXIT_SUCCESS);
+  TEST_ASSERT (n_results == 3);
+  for (size_t i = 0; i < n_results; i++)
+    TEST_ASSERT (results[i].status == RULE_BATCH_ITEM_DONE);
+  free (results);
+
+  TEST_ASSERT (rule_get_single_full (connection, first.id, TABLE_ON, &read) == EXIT_SUCCESS);
+  TEST_ASSERT (read.hour == 7 && !read.active);
+  TEST_ASSERT (count_rules (connection, TABLE_OFF) == 0);
+
+  rule_batch_finalize (&batch);
+  TEST_ASSERT (batch == NULL);
+}
+
+// A failed operation rolls everything back; added rules report id 0
+static void
+test_abort (DatabaseConnection *connection)
+{
+  RuleBatch *batch = rule_batch_begin (connection, true);
+  RuleBatchResult *results;
+  size_t n_results;
+  uint16_t before = count_rules (connection, TABLE_ON);
+  Rule rule = test_rule (TABLE_ON, 8, 0, DAY_BIT (1));
+
+  TEST_ASSERT (rule_batch_add (batch, &rule) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_batch_delete (batch, 999, TABLE_ON) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_batch_add (batch, &rule) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_batch_commit (batch, &results, &n_results) == EXIT_FAILURE);
+
+  TEST_ASSERT (n_results == 3);
+  TEST_ASSERT (results[0].status == RULE_BATCH_ITEM_ROLLED_BACK && results[0].id == 0);
+  TEST_ASSERT (results[1].status == RULE_BATCH_ITEM_FAILED && results[1].id == 999);
+  TEST_ASSERT (results[2].status == RULE_BATCH_ITEM_ROLLED_BACK && results[2].id == 0);
+  TEST_ASSERT (count_rules (connection, TABLE_ON) == before);
+  free (results);
+
+  rule_batch_finalize (&batch);
+}
+
+// Without abort_on_error, failed operations are reported, the others committed
+static void
+test_partial (DatabaseConnection *connection)
+{
+  RuleBatch *batch = rule_batch_begin (connection, false);
+  RuleBatchResult *results;
+  size_t n_results;
+  uint16_t before = count_rules (connection, TABLE_ON);
+  Rule valid = test_rule (TABLE_ON, 9, 0, DAY_BIT (2));
+  Rule invalid = test_rule (TABLE_ON, 25, 0, DAY_BIT (2));
+
+  TEST_ASSERT (rule_batch_add (batch, &valid) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_batch_add (batch, &invalid) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_batch_commit (batch, &results, &n_results) == EXIT_SUCCESS);
+
+  TEST_ASSERT (results[0].status == RULE_BATCH_ITEM_DONE && results[0].id != 0);
+  TEST_ASSERT (results[1].status == RULE_BATCH_ITEM_FAILED && results[1].id == 0);
+  TEST_ASSERT (count_rules (connection, TABLE_ON) == before + 1);
+  free (results);
+
+  rule_batch_finalize (&batch);
+}
+
+// Another handle holds the write lock: BEGIN fails, nothing gets an id
+static void
+test_begin_fails (void)
+{
+  ConnectionOptions options;
+  DatabaseConnection *connection;
+  RuleBatch *batch;
+  RuleBatchResult *results;
+  size_t n_results;
+  Rule rule = test_rule (TABLE_ON, 10, 0, DAY_BIT (3));
+  sqlite3 *locker;
+
+  database_connection_options_init (&options, CONNECTION_PROFILE_DEFAULT);
+  options.busy_timeout_ms = 0;
+  connection = database_connection_open_with_options (&options);
+  TEST_ASSERT (connection != NULL);
+
+  TEST_ASSERT (sqlite3_open (DB_PATH, &locker) == SQLITE_OK);
+  TEST_ASSERT (sqlite3_exec (locker, "BEGIN EXCLUSIVE;", NULL, NULL, NULL) == SQLITE_OK);
+
+  batch = rule_batch_begin (connection, true);
+  TEST_ASSERT (rule_batch_add (batch, &rule) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_batch_commit (batch, &results, &n_results) == EXIT_FAILURE);
+  TEST_ASSERT (n_results == 1);
+  TEST_ASSERT (results[0].status == RULE_BATCH_ITEM_ROLLED_BACK && results[0].id == 0);
+  free (results);
+
+  sqlite3_exec (locker, "ROLLBACK;", NULL, NULL, NULL);
+  sqlite3_close (locker);
+
+  rule_batch_finalize (&batch);
+  database_connection_close (&connection);
+}
+
+int
+main (void)
+{
+  DatabaseConnection *connection;
+
+  test_database_create (NULL);
+
+  connection = database_connection_open (false);
+  TEST_ASSERT (connection != NULL);
+
+  test_commit (connection);
+  test_abort (connection);
+  test_partial (connection);
+
+  database_connection_close (&connection);
+
+  test_begin_fails ();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,118 @@
+/* test-common.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+
+#include "test-common.h"
+
+// The schema before any migration (version 0)
+#define LEGACY_SCHEMA \
+  "CREATE TABLE rules_turnon ("\
+  " id INTEGER PRIMARY KEY AUTOINCREMENT, rule_name TEXT NOT NULL, rule_time TEXT NOT NULL,"\
+  " sun INTEGER NOT NULL, mon INTEGER NOT NULL, tue INTEGER NOT NULL, wed INTEGER NOT NULL,"\
+  " thu INTEGER NOT NULL, fri INTEGER NOT NULL, sat INTEGER NOT NULL,"\
+  " active INTEGER NOT NULL);"\
+  "CREATE TABLE rules_turnoff ("\
+  " id INTEGER PRIMARY KEY AUTOINCREMENT, rule_name TEXT NOT NULL, rule_time TEXT NOT NULL,"\
+  " sun INTEGER NOT NULL, mon INTEGER NOT NULL, tue INTEGER NOT NULL, wed INTEGER NOT NULL,"\
+  " thu INTEGER NOT NULL, fri INTEGER NOT NULL, sat INTEGER NOT NULL,"\
+  " active INTEGER NOT NULL, mode INTEGER NOT NULL);"\
+  "CREATE TABLE config ("\
+  " id INTEGER PRIMARY KEY, cli_version TEXT, localtime INTEGER, default_mode INTEGER,"\
+  " notification_time INTEGER, shutdown_fail INTEGER);"\
+  "CREATE TABLE custom_schedule ("\
+  " id INTEGER PRIMARY KEY, hour INTEGER, minutes INTEGER, day INTEGER, month INTEGER,"\
+  " year INTEGER, mode INTEGER);"\
+  "INSERT INTO config VALUES (1, '" VERSION "', 1, 2, 0, 0);"\
+  "INSERT INTO custom_schedule VALUES (1, 0, 0, 1, 1, 2000, 0);"
+
+void
+test_database_exec (const char *sql)
+{
+  sqlite3 *db = NULL;
+  char *message = NULL;
+
+  TEST_ASSERT (sqlite3_open (DB_PATH, &db) == SQLITE_OK);
+  if (sqlite3_exec (db, sql, NULL, NULL, &message) != SQLITE_OK)
+    {
+      fprintf (stderr, "%s\n", message);
+      sqlite3_free (message);
+      sqlite3_close (db);
+      exit (EXIT_FAILURE);
+    }
+  sqlite3_close (db);
+}
+
+void
+test_database_create (const char *sql)
+{
+  TEST_ASSERT (mkdir (DB_DIR, 0755) == 0 || errno == EEXIST);
+
+  unlink (DB_PATH);
+  unlink (DB_PATH "-wal");
+  unlink (DB_PATH "-shm");
+
+  test_database_exec (LEGACY_SCHEMA);
+  if (sql != NULL)
+    test_database_exec (sql);
+}
+
+Rule
+test_rule (const Table    table,
+           const int      hour,
+           const int      minutes,
+           const uint8_t  days)
+{
+  Rule rule = {
+    .hour = hour,
+    .minutes = minutes,
+    .days = days,
+    .active = true,
+    .mode = (table == TABLE_OFF) ? MODE_OFF : MODE_LAST,
+    .table = table,
+  };
+
+  snprintf (rule.name, RULE_NAME_LENGTH, "%02d:%02d", hour, minutes);
+
+  return rule;
+}
+
+time_t
+test_local_time (const int year,
+                 const int month,
+                 const int day,
+                 const int hour,
+                 const int minutes)
+{
+  struct tm local = {
+    .tm_year = year - 1900,
+    .tm_mon = month - 1,
+    .tm_mday = day,
+    .tm_hour = hour,
+    .tm_min = minutes,
+    .tm_isdst = -1,
+  };
+
+  return mktime (&local);
+}
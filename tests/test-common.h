@@ -0,0 +1,63 @@
+/* test-common.h
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef TEST_COMMON_H_
+#define TEST_COMMON_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "database-connection.h"
+#include "get-time.h"
+
+// Stops the test at the first failed check
+#define TEST_ASSERT(condition) \
+  do \
+    { \
+      if (!(condition)) \
+        { \
+          fprintf (stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+          exit (EXIT_FAILURE); \
+        } \
+    } \
+  while (0)
+
+/*
+ * Creates DB_PATH (each test is built with a DB_DIR of its own) with the
+ * legacy schema, version 0, plus the given SQL (NULL: none) to fill it, so
+ * that opening it runs every migration
+ */
+void test_database_create (const char *sql);
+// Runs SQL on the file through a handle of its own, bypassing the library
+void test_database_exec (const char *sql);
+
+Rule test_rule (const Table    table,
+                const int      hour,
+                const int      minutes,
+                const uint8_t  days);
+
+// Instant of a local date and time, in the TZ the test set
+time_t test_local_time (const int year,
+                        const int month,
+                        const int day,
+                        const int hour,
+                        const int minutes);
+
+#endif /* TEST_COMMON_H_ */
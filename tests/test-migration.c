@@ -0,0 +1,122 @@
+/* test-migration.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <string.h>
+
+#include "test-common.h"
+
+// Rule 3 was deleted, so its id must not be handed out again
+#define LEGACY_RULES \
+  "INSERT INTO rules_turnon VALUES (1, 'Morning', '07:30:00', 0, 1, 1, 1, 1, 1, 0, 1);"\
+  "INSERT INTO rules_turnon VALUES (2, 'Weekend', '09:05:00', 1, 0, 0, 0, 0, 0, 1, 0);"\
+  "INSERT INTO rules_turnon VALUES (3, 'Deleted', '10:00:00', 1, 1, 1, 1, 1, 1, 1, 1);"\
+  "DELETE FROM rules_turnon WHERE id = 3;"\
+  "INSERT INTO rules_turnoff VALUES (1, 'Night', '23:59:00', 1, 1, 1, 1, 1, 1, 1, 1, 4);"
+
+// Read-only handles get the file upgraded; values survive the rebuilds
+static void
+test_read_only_upgrade (void)
+{
+  ConnectionOptions options;
+  DatabaseConnection *connection;
+  Rule *rules;
+  uint16_t rowcount;
+
+  test_database_create (LEGACY_RULES);
+
+  database_connection_options_init (&options, CONNECTION_PROFILE_READ_ONLY_SCANNER);
+  connection = database_connection_open_with_options (&options);
+  TEST_ASSERT (connection != NULL);
+
+  TEST_ASSERT (rule_get_all_full (connection, TABLE_ON, &rules, &rowcount) == EXIT_SUCCESS);
+  TEST_ASSERT (rowcount == 2);
+  TEST_ASSERT (rules[0].id == 1 && strcmp (rules[0].name, "Morning") == 0);
+  TEST_ASSERT (rules[0].hour == 7 && rules[0].minutes == 30);
+  TEST_ASSERT (rules[0].days == 0x3E && rules[0].active);
+  TEST_ASSERT (rules[1].hour == 9 && rules[1].minutes == 5);
+  TEST_ASSERT (rules[1].days == (DAY_BIT (0) | DAY_BIT (6)) && !rules[1].active);
+  free (rules);
+
+  TEST_ASSERT (rule_get_all_full (connection, TABLE_OFF, &rules, &rowcount) == EXIT_SUCCESS);
+  TEST_ASSERT (rowcount == 1);
+  TEST_ASSERT (rules[0].hour == 23 && rules[0].minutes == 59);
+  TEST_ASSERT (rules[0].days == DAYS_ALL && rules[0].mode == MODE_OFF);
+  free (rules);
+
+  database_connection_close (&connection);
+}
+
+// The rebuilt tables keep AUTOINCREMENT and the sequence of the old ones
+static void
+test_ids_not_reused (void)
+{
+  DatabaseConnection *connection = database_connection_open (false);
+  Rule rule = test_rule (TABLE_ON, 11, 0, DAY_BIT (1));
+
+  TEST_ASSERT (connection != NULL);
+  TEST_ASSERT (rule_add_full (connection, &rule) == 4);
+
+  // Deleting the newest rule doesn't free its id either
+  TEST_ASSERT (rule_delete_full (connection, 4, TABLE_ON) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_add_full (connection, &rule) == 5);
+
+  database_connection_close (&connection);
+}
+
+// Immutable handles never upgrade; read-only ones don't while a writer is open
+static void
+test_refused_upgrades (void)
+{
+  ConnectionOptions options;
+  DatabaseConnection *writer, *reader;
+
+  test_database_create (NULL);
+
+  database_connection_options_init (&options, CONNECTION_PROFILE_BOOT_ONESHOT);
+  options.immutable = true;
+  TEST_ASSERT (database_connection_open_with_options (&options) == NULL);
+
+  // The writer keeps the upgraded file open; a new legacy one replaces it
+  writer = database_connection_open (false);
+  TEST_ASSERT (writer != NULL);
+  test_database_create (NULL);
+
+  TEST_ASSERT (database_connection_open (true) == NULL);
+
+  database_connection_close (&writer);
+  reader = database_connection_open (true);
+  TEST_ASSERT (reader != NULL);
+  database_connection_close (&reader);
+
+  // Current now: immutable opens work
+  reader = database_connection_open_with_options (&options);
+  TEST_ASSERT (reader != NULL);
+  database_connection_close (&reader);
+}
+
+int
+main (void)
+{
+  test_read_only_upgrade ();
+  test_ids_not_reused ();
+  test_refused_upgrades ();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,227 @@
+/* test-occurrence.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+// Local times and instants from the offsets table, compared to libc
+
+#include "test-common.h"
+#include "rule-occurrence.h"
+
+// Half hour DST (Lord Howe), southern hemisphere, no DST at all
+static const char *ZONES[] = {
+  "Europe/Berlin", "America/New_York", "Australia/Sydney", "Australia/Lord_Howe", "Asia/Kolkata", "UTC"
+};
+
+#define YEAR_2026 1767225600
+#define STEP (7 * 60 + 13)   // seconds; not a divisor of an hour, to visit every minute
+
+static void
+set_zone (const char *zone)
+{
+  setenv ("TZ", zone, 1);
+  tzset ();
+}
+
+static void
+test_dates (void)
+{
+  // -400 to +400 years around 2000, every 3 days
+  for (int64_t days = -157000; days < 135000; days += 3)
+    {
+      time_t instant = (time_t) days * 86400;
+      struct tm utc;
+      int year, month, day;
+
+      TEST_ASSERT (gmtime_r (&instant, &utc) != NULL);
+      occurrence_date_from_days (days, &year, &month, &day);
+      TEST_ASSERT (year == utc.tm_year + 1900 && month == utc.tm_mon + 1 && day == utc.tm_mday);
+      TEST_ASSERT (occurrence_days_from_date (year, month, day) == days);
+      TEST_ASSERT (occurrence_weekday (days) == utc.tm_wday);
+    }
+}
+
+// Instants to local date and minute, as localtime_r
+static void
+test_local (TzOffsets *tz)
+{
+  for (time_t instant = YEAR_2026; instant < YEAR_2026 + 366 * 86400; instant += STEP)
+    {
+      struct tm local;
+      int64_t day;
+      int minute;
+
+      TEST_ASSERT (localtime_r (&instant, &local) != NULL);
+      TEST_ASSERT (occurrence_local (tz, instant, &day, &minute) == EXIT_SUCCESS);
+      TEST_ASSERT (occurrence_days_from_date (local.tm_year + 1900, local.tm_mon + 1, local.tm_mday) == day);
+      TEST_ASSERT (local.tm_hour * 60 + local.tm_min == minute);
+    }
+}
+
+// Local date and minute to instants: every wall time that exists maps back
+static void
+test_at (TzOffsets *tz)
+{
+  int64_t first = occurrence_days_from_date (2026, 1, 1);
+  int n_gaps = 0, n_overlaps = 0;
+
+  for (int64_t day = first; day < first + 366; day++)
+    {
+      for (int minute = (int) (day % 7); minute < 1440; minute += 7)
+        {
+          Occurrence occurrence;
+          struct tm local;
+          time_t earlier;
+
+          TEST_ASSERT (occurrence_at (tz, day, minute, &occurrence) == EXIT_SUCCESS);
+          TEST_ASSERT (localtime_r (&occurrence.epoch, &local) != NULL);
+          TEST_ASSERT (local.tm_year + 1900 == occurrence.year && local.tm_mon + 1 == occurrence.month);
+          TEST_ASSERT (local.tm_mday == occurrence.day);
+          TEST_ASSERT (local.tm_hour == occurrence.hour && local.tm_min == occurrence.minutes);
+
+          switch (occurrence.dst)
+            {
+            case OCCURRENCE_DST_NONE:
+              TEST_ASSERT (occurrence_days_from_date (occurrence.year, occurrence.month, occurrence.day) == day);
+              TEST_ASSERT (occurrence.hour * 60 + occurrence.minutes == minute);
+              break;
+
+            case OCCURRENCE_DST_GAP:
+              // Moved forward past the skipped wall time
+              n_gaps++;
+              TEST_ASSERT (occurrence.hour * 60 + occurrence.minutes > minute
+                           || occurrence_days_from_date (occurrence.year, occurrence.month, occurrence.day) > day);
+              break;
+
+            case OCCURRENCE_DST_OVERLAP:
+              // The earlier of the two instants showing that wall time
+              n_overlaps++;
+              TEST_ASSERT (occurrence.hour * 60 + occurrence.minutes == minute);
+              earlier = occurrence.epoch - 3600;
+              TEST_ASSERT (localtime_r (&earlier, &local) != NULL);
+              TEST_ASSERT (local.tm_hour * 60 + local.tm_min != minute || local.tm_mday != occurrence.day);
+              break;
+            }
+        }
+    }
+
+  // Zones with DST have both, the others none
+  TEST_ASSERT ((n_gaps > 0) == (n_overlaps > 0));
+}
+
+// Europe/Berlin, 2026: 02:00 to 03:00 on March 29 is skipped, 02:00 to 03:00 on October 25 happens twice
+static void
+test_berlin (TzOffsets *tz)
+{
+  Occurrence occurrence;
+
+  TEST_ASSERT (occurrence_at (tz, occurrence_days_from_date (2026, 3, 29), 2 * 60 + 30, &occurrence) == EXIT_SUCCESS);
+  TEST_ASSERT (occurrence.dst == OCCURRENCE_DST_GAP);
+  TEST_ASSERT (occurrence.hour == 3 && occurrence.minutes == 30);
+  TEST_ASSERT (occurrence.epoch == test_local_time (2026, 3, 29, 3, 30));
+
+  TEST_ASSERT (occurrence_at (tz, occurrence_days_from_date (2026, 10, 25), 2 * 60 + 30, &occurrence) == EXIT_SUCCESS);
+  TEST_ASSERT (occurrence.dst == OCCURRENCE_DST_OVERLAP);
+  TEST_ASSERT (occurrence.hour == 2 && occurrence.minutes == 30);
+  TEST_ASSERT (occurrence.epoch == 1792888200);   // 00:30 UTC, still CEST
+
+  TEST_ASSERT (occurrence_at (tz, occurrence_days_from_date (2026, 10, 25), 3 * 60, &occurrence) == EXIT_SUCCESS);
+  TEST_ASSERT (occurrence.dst == OCCURRENCE_DST_NONE);
+  TEST_ASSERT (occurrence.epoch == 1792893600);   // 02:00 UTC, CET
+}
+
+// The cached offsets follow a change of TZ
+static void
+test_zone_change (TzOffsets *tz)
+{
+  int64_t day;
+  int minute;
+
+  set_zone ("America/New_York");
+  tz_offsets_check_zone (tz);
+  TEST_ASSERT (occurrence_local (tz, YEAR_2026, &day, &minute) == EXIT_SUCCESS);
+  TEST_ASSERT (minute == 19 * 60);
+
+  set_zone ("Asia/Tokyo");
+  tz_offsets_check_zone (tz);
+  TEST_ASSERT (occurrence_local (tz, YEAR_2026, &day, &minute) == EXIT_SUCCESS);
+  TEST_ASSERT (minute == 9 * 60);
+}
+
+// The wake up time of a daily 02:30 rule, the night the clocks go forward
+static void
+test_upcoming_gap (void)
+{
+  DatabaseConnection *connection;
+  FakeTimeSource clock;
+  Rule rule = test_rule (TABLE_ON, 2, 30, DAYS_ALL);
+  RtcwakeArgs args;
+
+  set_zone ("Europe/Berlin");
+
+  test_database_create (NULL);
+  connection = database_connection_open (false);
+  TEST_ASSERT (connection != NULL);
+  TEST_ASSERT (rule_add_full (connection, &rule) != 0);
+
+  fake_time_source_init (&clock, test_local_time (2026, 3, 28, 23, 0));
+  get_time_set_source (&clock.source);
+
+  TEST_ASSERT (rule_get_upcoming_on_full (connection, &args, MODE_LAST) == RTCWAKE_ARGS_RETURN_SUCESS);
+  TEST_ASSERT (args.epoch == test_local_time (2026, 3, 29, 3, 30));
+  TEST_ASSERT (args.day == 29 && args.month == 3 && args.year == 2026);
+  TEST_ASSERT (args.hour == 3 && args.minutes == 30);
+
+  // The next night is back to normal
+  fake_time_source_set (&clock, test_local_time (2026, 3, 29, 12, 0));
+  TEST_ASSERT (rule_get_upcoming_on_full (connection, &args, MODE_LAST) == RTCWAKE_ARGS_RETURN_SUCESS);
+  TEST_ASSERT (args.epoch == test_local_time (2026, 3, 30, 2, 30));
+
+  // A change the fingerprint can't see can still be forced
+  database_connection_invalidate_time_zone (connection);
+  TEST_ASSERT (rule_get_upcoming_on_full (connection, &args, MODE_LAST) == RTCWAKE_ARGS_RETURN_SUCESS);
+  TEST_ASSERT (args.epoch == test_local_time (2026, 3, 30, 2, 30));
+
+  get_time_set_source (NULL);
+  database_connection_close (&connection);
+}
+
+int
+main (void)
+{
+  TzOffsets tz = { 0 };
+
+  test_dates ();
+
+  for (size_t i = 0; i < sizeof (ZONES) / sizeof (ZONES[0]); i++)
+    {
+      set_zone (ZONES[i]);
+      tz_offsets_check_zone (&tz);
+      test_local (&tz);
+      test_at (&tz);
+    }
+
+  set_zone ("Europe/Berlin");
+  tz_offsets_check_zone (&tz);
+  test_berlin (&tz);
+  test_zone_change (&tz);
+
+  test_upcoming_gap ();
+
+  return EXIT_SUCCESS;
+}
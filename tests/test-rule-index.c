@@ -0,0 +1,272 @@
+/* test-rule-index.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * The next fire times from the weekly index, compared to a scan of every
+ * rule; in UTC, as DST is covered by test-occurrence.c
+ */
+
+#include "test-common.h"
+#include "rule-index.h"
+
+#define N_RULES 150
+#define N_INSTANTS 200
+#define N_EVENTS 40
+
+typedef struct
+{
+  time_t timestamp;
+  Table table;
+  uint16_t id;
+} Expected;
+
+static Rule *rules[TABLE_LAST];
+static uint16_t n_rules[TABLE_LAST];
+
+static void
+read_rules (DatabaseConnection *connection)
+{
+  for (int t = 0; t < TABLE_LAST; t++)
+    {
+      free (rules[t]);
+      TEST_ASSERT (rule_get_all_full (connection, (Table) t, &rules[t], &n_rules[t]) == EXIT_SUCCESS);
+    }
+}
+
+// Minutes from "now" to the next occurrence of a rule on "day" (strictly after)
+static int
+minutes_until (const time_t  now,
+               const Rule   *rule,
+               const int     day)
+{
+  int now_minute = (int) ((now / 60 + 4 * 1440) % MINUTES_PER_WEEK);   // 1970-01-01 was a Thursday
+  int delta = day * 1440 + rule->hour * 60 + rule->minutes - now_minute;
+
+  return (delta <= 0) ? delta + MINUTES_PER_WEEK : delta;
+}
+
+// Brute force next occurrence of a table: *id 0 if there's none
+static void
+scan_next (const time_t  now,
+           const Table   table,
+           time_t       *timestamp,
+           uint16_t     *id)
+{
+  int best = MINUTES_PER_WEEK + 1;
+
+  *id = 0;
+
+  for (uint16_t i = 0; i < n_rules[table]; i++)
+    {
+      const Rule *rule = &rules[table][i];
+
+      for (int d = 0; rule->active && d < 7; d++)
+        {
+          int delta;
+
+          if (!(rule->days & DAY_BIT (d)))
+            continue;
+
+          delta = minutes_until (now, rule, d);
+          if (delta < best || (delta == best && rule->id < *id))
+            {
+              best = delta;
+              *id = rule->id;
+            }
+        }
+    }
+
+  *timestamp = (now / 60 + best) * 60;
+}
+
+static int
+compare_expected (const void *a,
+                  const void *b)
+{
+  const Expected *x = a;
+  const Expected *y = b;
+
+  if (x->timestamp != y->timestamp)
+    return (x->timestamp < y->timestamp) ? -1 : 1;
+  if (x->table != y->table)
+    return (x->table < y->table) ? -1 : 1;
+
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+static void
+check_events (DatabaseConnection *connection,
+              const time_t        now)
+{
+  Expected *expected = malloc ((size_t) (n_rules[TABLE_ON] + n_rules[TABLE_OFF]) * 7 * 2 * sizeof (Expected));
+  size_t n_expected = 0, n_events;
+  RuleEvent *events;
+
+  TEST_ASSERT (expected != NULL);
+
+  // Two weeks of occurrences are more than N_EVENTS
+  for (int t = 0; t < TABLE_LAST; t++)
+    {
+      for (uint16_t i = 0; i < n_rules[t]; i++)
+        {
+          for (int d = 0; rules[t][i].active && d < 7; d++)
+            {
+              time_t first;
+
+              if (!(rules[t][i].days & DAY_BIT (d)))
+                continue;
+
+              first = (now / 60 + minutes_until (now, &rules[t][i], d)) * 60;
+              for (int week = 0; week < 2; week++)
+                expected[n_expected++] = (Expected) {
+                  .timestamp = first + week * MINUTES_PER_WEEK * 60,
+                  .table = (Table) t,
+                  .id = rules[t][i].id,
+                };
+            }
+        }
+    }
+  qsort (expected, n_expected, sizeof (Expected), compare_expected);
+
+  TEST_ASSERT (rule_get_upcoming_events (connection, now, 0, N_EVENTS, &events, &n_events) == EXIT_SUCCESS);
+  TEST_ASSERT (n_events == ((n_expected < N_EVENTS) ? n_expected : N_EVENTS));
+
+  for (size_t i = 0; i < n_events; i++)
+    {
+      TEST_ASSERT (events[i].timestamp == expected[i].timestamp);
+      TEST_ASSERT (events[i].table == expected[i].table);
+      TEST_ASSERT (events[i].id == expected[i].id);
+    }
+
+  free (events);
+  free (expected);
+}
+
+static void
+check_instants (DatabaseConnection *connection,
+                FakeTimeSource     *clock)
+{
+  read_rules (connection);
+
+  for (int i = 0; i < N_INSTANTS; i++)
+    {
+      time_t now = 1767225600 + (time_t) rand () % (365 * 86400);    // 2026
+      time_t timestamp;
+      uint16_t expected_id, id;
+      RtcwakeArgs args;
+
+      fake_time_source_set (clock, now);
+
+      scan_next (now, TABLE_OFF, &timestamp, &expected_id);
+      if (expected_id == 0)
+        TEST_ASSERT (rule_get_upcoming_off_full (connection, &args, &id) == RTCWAKE_ARGS_RETURN_NOT_FOUND);
+      else
+        {
+          TEST_ASSERT (rule_get_upcoming_off_full (connection, &args, &id) == RTCWAKE_ARGS_RETURN_SUCESS);
+          TEST_ASSERT (id == expected_id);
+          TEST_ASSERT (args.epoch == timestamp);
+        }
+
+      scan_next (now, TABLE_ON, &timestamp, &expected_id);
+      if (expected_id == 0)
+        TEST_ASSERT (rule_get_upcoming_on_full (connection, &args, MODE_LAST) == RTCWAKE_ARGS_RETURN_NOT_FOUND);
+      else
+        {
+          TEST_ASSERT (rule_get_upcoming_on_full (connection, &args, MODE_LAST) == RTCWAKE_ARGS_RETURN_SUCESS);
+          TEST_ASSERT (args.epoch == timestamp);
+        }
+
+      if (i % 20 == 0)
+        check_events (connection, now);
+    }
+}
+
+int
+main (void)
+{
+  DatabaseConnection *connection;
+  FakeTimeSource clock;
+
+  setenv ("TZ", "UTC", 1);
+  srand (13);
+
+  test_database_create (NULL);
+  connection = database_connection_open (false);
+  TEST_ASSERT (connection != NULL);
+
+  fake_time_source_init (&clock, 0);
+  get_time_set_source (&clock.source);
+
+  // Empty tables
+  check_instants (connection, &clock);
+
+  for (int i = 0; i < N_RULES; i++)
+    {
+      for (int t = 0; t < TABLE_LAST; t++)
+        {
+          Rule rule = test_rule ((Table) t, rand () % 24, rand () % 60, (uint8_t) (rand () & DAYS_ALL));
+
+          rule.active = rand () % 4 != 0;
+          TEST_ASSERT (rule_add_full (connection, &rule) != 0);
+        }
+    }
+  check_instants (connection, &clock);
+
+  // Changes made through the connection patch the index
+  for (int i = 0; i < N_RULES / 3; i++)
+    {
+      Table table = (Table) (rand () % TABLE_LAST);
+      uint16_t id = (uint16_t) (1 + rand () % N_RULES);
+      Rule rule;
+
+      switch (rand () % 3)
+        {
+        case 0:
+          rule_delete_full (connection, id, table);
+          break;
+
+        case 1:
+          if (rule_get_single_full (connection, id, table, &rule) == EXIT_SUCCESS && rule.id != 0)
+            TEST_ASSERT (rule_enable_disable_full (connection, id, table, !rule.active) == EXIT_SUCCESS);
+          break;
+
+        default:
+          if (rule_get_single_full (connection, id, table, &rule) == EXIT_SUCCESS && rule.id != 0)
+            {
+              rule.hour = rand () % 24;
+              rule.days = (uint8_t) (rand () & DAYS_ALL);
+              TEST_ASSERT (rule_edit_full (connection, &rule) != 0);
+            }
+        }
+    }
+  check_instants (connection, &clock);
+
+  // Changes made by another connection rebuild it
+  test_database_exec ("UPDATE rules_turnon SET rule_minute = (rule_minute + 7) % 1440;"
+                      "UPDATE rules_turnoff SET active = NOT active;");
+  check_instants (connection, &clock);
+
+  get_time_set_source (NULL);
+  free (rules[TABLE_ON]);
+  free (rules[TABLE_OFF]);
+  database_connection_close (&connection);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,248 @@
+/* test-rule-query.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+// Filtered, ordered pages of rules, compared to filtering and sorting in C
+
+#include <string.h>
+
+#include "test-common.h"
+#include "rule-index.h"
+
+#define N_RULES 120
+#define NO_FIRE 100000
+
+static const char *PREFIXES[] = { NULL, "a", "ab", "b\xFF", "z" };
+static const uint16_t PAGE_SIZES[] = { 1, 3, 7, 200 };
+
+typedef struct
+{
+  Rule rule;
+  int key;
+} Sorted;
+
+static int now_minute;
+
+static int
+sort_key (const Rule      *rule,
+          const RuleOrder  order)
+{
+  int key = NO_FIRE;
+
+  switch (order)
+    {
+    case RULE_ORDER_ID:
+      return rule->id;
+
+    case RULE_ORDER_TIME:
+      return rule->hour * 60 + rule->minutes;
+
+    default:
+      for (int d = 0; d < 7; d++)
+        {
+          int delta = (d * 1440 + rule->hour * 60 + rule->minutes - now_minute + MINUTES_PER_WEEK - 1)
+                      % MINUTES_PER_WEEK + 1;
+
+          if ((rule->days & DAY_BIT (d)) && delta < key)
+            key = delta;
+        }
+      return key;
+    }
+}
+
+static bool
+matches (const Rule      *rule,
+         const RuleQuery *query)
+{
+  int minute = rule->hour * 60 + rule->minutes;
+
+  if (query->filter.active_only && !rule->active)
+    return false;
+  if (query->filter.days != 0 && !(rule->days & query->filter.days))
+    return false;
+  if (query->time_range && (minute < query->minute_from || minute > query->minute_to))
+    return false;
+
+  return query->name_prefix == NULL
+         || strncmp (rule->name, query->name_prefix, strlen (query->name_prefix)) == 0;
+}
+
+static int
+compare_sorted (const void *a,
+                const void *b)
+{
+  const Sorted *x = a;
+  const Sorted *y = b;
+
+  if (x->key != y->key)
+    return (x->key < y->key) ? -1 : 1;
+
+  return (x->rule.id > y->rule.id) - (x->rule.id < y->rule.id);
+}
+
+static void
+check_query (DatabaseConnection *connection,
+             const Rule         *all,
+             const uint16_t      n_all,
+             const RuleQuery    *query,
+             const uint16_t      page_size)
+{
+  Sorted expected[N_RULES];
+  Rule page[200];
+  size_t n_expected = 0, n_read = 0;
+  RuleCursor cursor = { 0 };
+  uint16_t rowcount;
+
+  for (uint16_t i = 0; i < n_all; i++)
+    {
+      if (matches (&all[i], query))
+        expected[n_expected++] = (Sorted) { .rule = all[i], .key = sort_key (&all[i], query->order) };
+    }
+  qsort (expected, n_expected, sizeof (Sorted), compare_sorted);
+
+  // Pages until a short one
+  do
+    {
+      TEST_ASSERT (rule_query (connection, TABLE_OFF, query, &cursor, page, page_size, &rowcount) == EXIT_SUCCESS);
+      TEST_ASSERT (rowcount <= page_size);
+
+      for (uint16_t i = 0; i < rowcount; i++, n_read++)
+        {
+          TEST_ASSERT (n_read < n_expected);
+          TEST_ASSERT (page[i].id == expected[n_read].rule.id);
+          TEST_ASSERT (strcmp (page[i].name, expected[n_read].rule.name) == 0);
+          TEST_ASSERT (page[i].days == expected[n_read].rule.days);
+          TEST_ASSERT (page[i].mode == expected[n_read].rule.mode);
+        }
+    }
+  while (rowcount == page_size);
+
+  TEST_ASSERT (n_read == n_expected);
+}
+
+static void
+test_invalid (DatabaseConnection *connection)
+{
+  RuleQuery query = { .time_range = true, .minute_from = 600, .minute_to = 500 };
+  RuleCursor cursor = { 0 };
+  Rule page[1];
+  uint16_t rowcount;
+
+  TEST_ASSERT (rule_query (connection, TABLE_OFF, &query, &cursor, page, 1, &rowcount) == EXIT_FAILURE);
+
+  query = (RuleQuery) { .order = RULE_ORDER_LAST };
+  TEST_ASSERT (rule_query (connection, TABLE_OFF, &query, &cursor, page, 1, &rowcount) == EXIT_FAILURE);
+}
+
+// Rules deleted or added behind the cursor don't shift the next pages
+static void
+test_keyset (DatabaseConnection *connection)
+{
+  RuleQuery query = { .order = RULE_ORDER_TIME };
+  RuleCursor cursor = { 0 };
+  Rule first[5], rest[N_RULES + 1], *all;
+  uint16_t rowcount, n_rest, n_all;
+  Rule early = test_rule (TABLE_OFF, 0, 0, DAYS_ALL);
+
+  TEST_ASSERT (rule_get_all_full (connection, TABLE_OFF, &all, &n_all) == EXIT_SUCCESS);
+
+  TEST_ASSERT (rule_query (connection, TABLE_OFF, &query, &cursor, first, 5, &rowcount) == EXIT_SUCCESS);
+  TEST_ASSERT (rowcount == 5);
+  TEST_ASSERT (first[4].hour * 60 + first[4].minutes > 0);
+
+  TEST_ASSERT (rule_delete_full (connection, first[0].id, TABLE_OFF) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_add_full (connection, &early) != 0);
+
+  TEST_ASSERT (rule_query (connection, TABLE_OFF, &query, &cursor, rest, N_RULES + 1, &n_rest) == EXIT_SUCCESS);
+  TEST_ASSERT (n_rest == n_all - 5);
+  for (uint16_t i = 0; i < n_rest; i++)
+    {
+      for (int j = 0; j < 5; j++)
+        TEST_ASSERT (rest[i].id != first[j].id);
+    }
+
+  free (all);
+}
+
+int
+main (void)
+{
+  DatabaseConnection *connection;
+  FakeTimeSource clock;
+  RuleQuery query = { 0 };
+  Rule *all;
+  uint16_t n_all;
+
+  setenv ("TZ", "UTC", 1);
+  srand (20);
+
+  test_database_create (NULL);
+  connection = database_connection_open (false);
+  TEST_ASSERT (connection != NULL);
+
+  // Wednesday 2026-03-04 13:20 UTC
+  fake_time_source_init (&clock, 1772630400);
+  get_time_set_source (&clock.source);
+  now_minute = 3 * 1440 + 13 * 60 + 20;
+
+  for (int i = 0; i < N_RULES; i++)
+    {
+      Rule rule = test_rule (TABLE_OFF, rand () % 24, rand () % 60,
+                             (uint8_t) ((rand () % 6 == 0) ? 0 : rand () & DAYS_ALL));
+
+      // Names share prefixes; a few end in 0xFF bytes
+      snprintf (rule.name, RULE_NAME_LENGTH, "%c%c%s",
+                "abz"[rand () % 3], "ab\xFF"[rand () % 3], (rand () % 2) ? "\xFF" : "x");
+      rule.active = rand () % 3 != 0;
+      rule.mode = (Mode) (rand () % (MODE_LAST + 1));
+      TEST_ASSERT (rule_add_full (connection, &rule) != 0);
+    }
+
+  TEST_ASSERT (rule_get_all_full (connection, TABLE_OFF, &all, &n_all) == EXIT_SUCCESS);
+
+  for (RuleOrder order = RULE_ORDER_ID; order < RULE_ORDER_LAST; order++)
+    {
+      for (size_t p = 0; p < sizeof (PREFIXES) / sizeof (PREFIXES[0]); p++)
+        {
+          for (int filter = 0; filter < 4; filter++)
+            {
+              query = (RuleQuery) {
+                .filter = { .active_only = filter & 1, .days = (filter & 2) ? DAY_BIT (1) | DAY_BIT (5) : 0 },
+                .time_range = p % 2,
+                .minute_from = 6 * 60,
+                .minute_to = 18 * 60 + 30,
+                .name_prefix = PREFIXES[p],
+                .order = order,
+              };
+
+              for (size_t s = 0; s < sizeof (PAGE_SIZES) / sizeof (PAGE_SIZES[0]); s++)
+                check_query (connection, all, n_all, &query, PAGE_SIZES[s]);
+            }
+        }
+    }
+  free (all);
+
+  test_invalid (connection);
+  test_keyset (connection);
+
+  get_time_set_source (NULL);
+  database_connection_close (&connection);
+
+  return EXIT_SUCCESS;
+}
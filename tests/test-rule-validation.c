@@ -0,0 +1,333 @@
+/* test-rule-validation.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+// Conflict reports of rule sets and across tables, compared to brute force
+
+#include <string.h>
+
+#include "test-common.h"
+#include "rule-index.h"
+
+#define N_SET 600
+#define N_DATABASE 200
+#define N_CROSS 150
+#define TOLERANCE 20
+#define NOTIFICATION_TIME 890   // seconds: rounded up to 15 minutes
+
+static bool
+same_slot (const Rule *a,
+           const Rule *b)
+{
+  return a->table == b->table && a->hour == b->hour && a->minutes == b->minutes;
+}
+
+// Few distinct times, so that many rules collide
+static Rule
+crowded_rule (void)
+{
+  Rule rule = test_rule ((Table) (rand () % TABLE_LAST), rand () % 2, rand () % 3,
+                         (uint8_t) ((rand () % 5 == 0) ? 0 : rand () & DAYS_ALL));
+
+  // Some invalid ones
+  if (rand () % 50 == 0)
+    rule.hour = 24;
+
+  return rule;
+}
+
+// Three rules in the same slot give the three pairs
+static void
+test_set_pairs (void)
+{
+  Rule rules[3];
+  RuleConflict *conflicts;
+  size_t n_conflicts;
+
+  for (int i = 0; i < 3; i++)
+    rules[i] = test_rule (TABLE_ON, 7, 0, DAYS_ALL);
+  rules[2].days = DAY_BIT (1);
+
+  TEST_ASSERT (rule_validate_time_batch (NULL, rules, 3, &conflicts, &n_conflicts) == EXIT_SUCCESS);
+  TEST_ASSERT (n_conflicts == 3);
+  TEST_ASSERT (conflicts[0].index == 0 && conflicts[0].other_index == 1 && conflicts[0].days == DAYS_ALL);
+  TEST_ASSERT (conflicts[1].index == 0 && conflicts[1].other_index == 2 && conflicts[1].days == DAY_BIT (1));
+  TEST_ASSERT (conflicts[2].index == 1 && conflicts[2].other_index == 2 && conflicts[2].days == DAY_BIT (1));
+  free (conflicts);
+}
+
+// Every colliding pair of a set, in index order
+static void
+test_set_random (void)
+{
+  Rule *rules = malloc (N_SET * sizeof (Rule));
+  RuleConflict *conflicts;
+  size_t n_conflicts, position = 0;
+
+  TEST_ASSERT (rules != NULL);
+  for (size_t i = 0; i < N_SET; i++)
+    rules[i] = crowded_rule ();
+
+  TEST_ASSERT (rule_validate_time_batch (NULL, rules, N_SET, &conflicts, &n_conflicts) == EXIT_SUCCESS);
+
+  for (size_t i = 0; i < N_SET; i++)
+    {
+      if (rules[i].hour > 23)
+        {
+          TEST_ASSERT (position < n_conflicts);
+          TEST_ASSERT (conflicts[position].kind == RULE_CONFLICT_INVALID);
+          TEST_ASSERT (conflicts[position].index == i);
+          position++;
+          continue;
+        }
+
+      for (size_t j = i + 1; j < N_SET; j++)
+        {
+          uint8_t shared = rules[i].days & rules[j].days;
+
+          if (rules[j].hour > 23 || !same_slot (&rules[i], &rules[j]) || shared == 0)
+            continue;
+
+          TEST_ASSERT (position < n_conflicts);
+          TEST_ASSERT (conflicts[position].kind == RULE_CONFLICT_SET);
+          TEST_ASSERT (conflicts[position].index == i);
+          TEST_ASSERT (conflicts[position].other_index == j);
+          TEST_ASSERT (conflicts[position].days == shared);
+          position++;
+        }
+    }
+  TEST_ASSERT (position == n_conflicts);
+
+  free (conflicts);
+  free (rules);
+}
+
+static int
+compare_ids (const void *a,
+             const void *b)
+{
+  const Rule *x = a;
+  const Rule *y = b;
+
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+// Against the database: the rules the set edits are left out
+static void
+test_set_database (DatabaseConnection *connection)
+{
+  RuleTimeValidator *validator;
+  Rule *stored, set[N_SET / 4];
+  uint16_t n_stored;
+  RuleConflict *conflicts;
+  size_t n_conflicts, position = 0;
+
+  for (int i = 0; i < N_DATABASE; i++)
+    {
+      Rule rule = crowded_rule ();
+
+      rule.table = TABLE_ON;
+      if (rule.hour > 23)
+        continue;
+      TEST_ASSERT (rule_add_full (connection, &rule) != 0);
+    }
+
+  TEST_ASSERT (rule_get_all_full (connection, TABLE_ON, &stored, &n_stored) == EXIT_SUCCESS);
+  qsort (stored, n_stored, sizeof (Rule), compare_ids);
+
+  // Slots shared with the stored rules; rules of the set collide too
+  for (size_t i = 0; i < N_SET / 4; i++)
+    {
+      set[i] = test_rule (TABLE_ON, (i / 6) % 2, (i / 2) % 3, DAY_BIT (i % 7));
+      // Every other rule edits a stored one
+      if (i % 2 == 1)
+        set[i].id = stored[rand () % n_stored].id;
+    }
+
+  validator = rule_validate_time_init_full (connection, TABLE_ON);
+  TEST_ASSERT (validator != NULL);
+  TEST_ASSERT (rule_validate_time_batch (validator, set, N_SET / 4, &conflicts, &n_conflicts) == EXIT_SUCCESS);
+
+  for (size_t i = 0; i < N_SET / 4; i++)
+    {
+      for (uint16_t s = 0; s < n_stored; s++)
+        {
+          uint8_t shared = set[i].days & stored[s].days;
+          bool edited = false;
+
+          for (size_t e = 0; e < N_SET / 4; e++)
+            edited |= set[e].id == stored[s].id;
+
+          if (edited || !same_slot (&set[i], &stored[s]) || shared == 0)
+            continue;
+
+          TEST_ASSERT (position < n_conflicts);
+          TEST_ASSERT (conflicts[position].kind == RULE_CONFLICT_DATABASE);
+          TEST_ASSERT (conflicts[position].index == i);
+          TEST_ASSERT (conflicts[position].other_id == stored[s].id);
+          TEST_ASSERT (conflicts[position].days == shared);
+          position++;
+        }
+
+      // Within the set
+      for (size_t j = i + 1; j < N_SET / 4; j++)
+        {
+          uint8_t shared = set[i].days & set[j].days;
+
+          if (!same_slot (&set[i], &set[j]) || shared == 0)
+            continue;
+
+          TEST_ASSERT (position < n_conflicts);
+          TEST_ASSERT (conflicts[position].kind == RULE_CONFLICT_SET);
+          TEST_ASSERT (conflicts[position].index == i && conflicts[position].other_index == j);
+          position++;
+        }
+    }
+  TEST_ASSERT (position == n_conflicts);
+
+  free (conflicts);
+  free (stored);
+  rule_validate_time_finalize (&validator);
+}
+
+static int
+compare_cross (const void *a,
+               const void *b)
+{
+  const CrossConflict *x = a;
+  const CrossConflict *y = b;
+
+  if (x->minute != y->minute)
+    return (x->minute < y->minute) ? -1 : 1;
+  if (x->turnoff_id != y->turnoff_id)
+    return (x->turnoff_id < y->turnoff_id) ? -1 : 1;
+  if (x->turnon_id != y->turnon_id)
+    return (x->turnon_id < y->turnon_id) ? -1 : 1;
+
+  return (x->gap > y->gap) - (x->gap < y->gap);
+}
+
+// Turn on occurrences from the notification time before to TOLERANCE after a turn off one
+static void
+test_cross_tables (DatabaseConnection *connection)
+{
+  int notice = (NOTIFICATION_TIME + 59) / 60;
+  Rule *on, *off;
+  uint16_t n_on, n_off;
+  CrossConflict *conflicts, *expected = NULL;
+  size_t n_conflicts, n_expected = 0;
+
+  test_database_exec ("DELETE FROM rules_turnon; DELETE FROM rules_turnoff;");
+  TEST_ASSERT (configuration_set_notification_time_full (connection, NOTIFICATION_TIME) == EXIT_SUCCESS);
+
+  for (int i = 0; i < N_CROSS; i++)
+    {
+      for (int t = 0; t < TABLE_LAST; t++)
+        {
+          Rule rule = test_rule ((Table) t, rand () % 24, rand () % 60, (uint8_t) (rand () & DAYS_ALL));
+
+          rule.active = rand () % 5 != 0;
+          TEST_ASSERT (rule_add_full (connection, &rule) != 0);
+        }
+    }
+
+  TEST_ASSERT (rule_get_all_full (connection, TABLE_ON, &on, &n_on) == EXIT_SUCCESS);
+  TEST_ASSERT (rule_get_all_full (connection, TABLE_OFF, &off, &n_off) == EXIT_SUCCESS);
+
+  for (uint16_t i = 0; i < n_off; i++)
+    {
+      for (int d = 0; off[i].active && d < 7; d++)
+        {
+          int minute = d * 1440 + off[i].hour * 60 + off[i].minutes;
+
+          if (!(off[i].days & DAY_BIT (d)))
+            continue;
+
+          for (uint16_t j = 0; j < n_on; j++)
+            {
+              for (int e = 0; on[j].active && e < 7; e++)
+                {
+                  int gap = e * 1440 + on[j].hour * 60 + on[j].minutes - minute;
+
+                  if (!(on[j].days & DAY_BIT (e)))
+                    continue;
+
+                  // The nearest occurrence, across the week boundary too
+                  gap = ((gap % MINUTES_PER_WEEK) + MINUTES_PER_WEEK) % MINUTES_PER_WEEK;
+                  if (gap > MINUTES_PER_WEEK / 2)
+                    gap -= MINUTES_PER_WEEK;
+                  if (gap < -notice || gap > TOLERANCE)
+                    continue;
+
+                  expected = realloc (expected, (n_expected + 1) * sizeof (CrossConflict));
+                  TEST_ASSERT (expected != NULL);
+                  expected[n_expected++] = (CrossConflict) {
+                    .turnoff_id = off[i].id,
+                    .turnon_id = on[j].id,
+                    .minute = minute,
+                    .gap = gap,
+                  };
+                }
+            }
+        }
+    }
+
+  TEST_ASSERT (rule_validate_cross_tables (connection, TOLERANCE, &conflicts, &n_conflicts) == EXIT_SUCCESS);
+  TEST_ASSERT (n_conflicts == n_expected);
+  TEST_ASSERT (n_expected > 0);
+
+  // Ordered by the turn off minute; ties in any order
+  for (size_t i = 1; i < n_conflicts; i++)
+    TEST_ASSERT (conflicts[i - 1].minute <= conflicts[i].minute);
+
+  qsort (conflicts, n_conflicts, sizeof (CrossConflict), compare_cross);
+  qsort (expected, n_expected, sizeof (CrossConflict), compare_cross);
+  for (size_t i = 0; i < n_conflicts; i++)
+    TEST_ASSERT (compare_cross (&conflicts[i], &expected[i]) == 0);
+  free (conflicts);
+
+  TEST_ASSERT (rule_validate_cross_tables (connection, 1441, &conflicts, &n_conflicts) == EXIT_FAILURE);
+  TEST_ASSERT (conflicts == NULL && n_conflicts == 0);
+
+  free (expected);
+  free (on);
+  free (off);
+}
+
+int
+main (void)
+{
+  DatabaseConnection *connection;
+
+  srand (7);
+
+  test_set_pairs ();
+  test_set_random ();
+
+  test_database_create (NULL);
+  connection = database_connection_open (false);
+  TEST_ASSERT (connection != NULL);
+
+  test_set_database (connection);
+  test_cross_tables (connection);
+
+  database_connection_close (&connection);
+
+  return EXIT_SUCCESS;
+}
@@ -24,77 +24,26 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <locale.h>
-#include <gio/gio.h>
-
-#define PORTAL_BUS_NAME             "org.freedesktop.portal.Desktop"
-#define PORTAL_OBJECT_PATH          "/org/freedesktop/portal/desktop"
-#define PORTAL_SETTINGS_INTERFACE   "org.freedesktop.portal.Settings"
-#define PORTAL_METHOD_NAME          "Read"
-#define CLOCK_FORMAT_SCHEMA         "org.gnome.desktop.interface"
-#define CLOCK_FORMAT_PROPERTY_NAME  "clock-format"
-
-// See https://gitlab.gnome.org/GNOME/gnome-clocks/-/blob/master/src/utils.vala?ref_type=heads#L223
-static int
-time_converter_get_format_using_dbus (TimeFormat *format)
-{
-  g_autoptr (GDBusConnection) connection = NULL;
-  g_autoptr (GError) error = NULL;
-  g_autoptr (GVariant) result = NULL;
-  g_autoptr (GVariant) child1 = NULL;
-  g_autoptr (GVariant) child2 = NULL;
-  const gchar *time_format = NULL;
-
-  connection = g_bus_get_sync (G_BUS_TYPE_SESSION,
-                               NULL,
-                               &error);
-
-  if (error != NULL)
-    {
-      DEBUG_PRINT (("[warning]: Failed to get time format using DBus - connection error: %s",
-                    error->message));
-      return EXIT_FAILURE;
-    }
-
-  result = g_dbus_connection_call_sync (connection,
-                                        PORTAL_BUS_NAME,
-                                        PORTAL_OBJECT_PATH,
-                                        PORTAL_SETTINGS_INTERFACE,
-                                        PORTAL_METHOD_NAME,
-                                        g_variant_new ("(ss)",
-                                                       CLOCK_FORMAT_SCHEMA,
-                                                       CLOCK_FORMAT_PROPERTY_NAME),
-                                        NULL,
-                                        G_DBUS_CALL_FLAGS_NONE,
-                                        -1,
-                                        NULL,
-                                        &error);
-
-  if (error != NULL)
-    {
-      DEBUG_PRINT (("[warning]: Failed to get time format using DBus - method call error: %s",
-                    error->message));
-      return EXIT_FAILURE;
-    }
-
-  g_variant_get (result, "(v)", &child1);
-  g_variant_get (child1, "v", &child2);
-  time_format = g_variant_get_string (child2, NULL);
 
-  DEBUG_PRINT (("[info]: DBus Setting time format: %s", time_format));
+#define LOCALE_FORMAT_UNKNOWN -1
 
-  *format = (g_strcmp0 (time_format, "12h") == 0) ?
-             TIME_FORMAT_TWELVE : TIME_FORMAT_TWENTYFOUR;
+/*
+ * The DBus backend is only linked in by the builds that want it (see
+ * meson.build); when it is, it's the default backend
+ */
+extern const TimeFormatBackend time_format_backend_dbus __attribute__ ((weak));
 
-  return EXIT_SUCCESS;
-}
+static atomic_int locale_format = LOCALE_FORMAT_UNKNOWN;
+static const TimeFormatBackend *_Atomic backend = NULL;
 
-static int
-time_converter_get_format_using_c_calls (TimeFormat *format)
+static TimeFormat
+probe_locale_format (void)
 {
   time_t now;
-  struct tm *tm_info;
+  struct tm tm_info;
   char buffer[256];
 
   // Set the locale to the user's default environment
@@ -102,39 +51,94 @@ time_converter_get_format_using_c_calls (TimeFormat *format)
 
   // Get the current time
   time (&now);
-  tm_info = localtime (&now);
+  localtime_r (&now, &tm_info);
 
   // Format the time in 12-hour format
-  strftime (buffer, sizeof (buffer), "%I:%M %p", tm_info);
+  strftime (buffer, sizeof (buffer), "%I:%M %p", &tm_info);
 
   DEBUG_PRINT (("[info]: got time using c calls %s\n", buffer));
 
   // Check if the formatted time contains AM or PM
   if (strstr (buffer, "AM") || strstr (buffer, "PM"))
-    *format = TIME_FORMAT_TWELVE;
+    return TIME_FORMAT_TWELVE;
   else
-    *format = TIME_FORMAT_TWENTYFOUR;
+    return TIME_FORMAT_TWENTYFOUR;
+}
 
-  return EXIT_SUCCESS;
+TimeFormat
+time_converter_get_locale_format (void)
+{
+  int format = atomic_load (&locale_format);
+
+  // Probing twice concurrently is harmless
+  if (format == LOCALE_FORMAT_UNKNOWN)
+    {
+      format = probe_locale_format ();
+      atomic_store (&locale_format, format);
+    }
+
+  return format;
+}
+
+static TimeFormat
+locale_peek_format (void)
+{
+  return time_converter_get_locale_format ();
+}
+
+static void
+locale_finalize (void)
+{
+  atomic_store (&locale_format, LOCALE_FORMAT_UNKNOWN);
+}
+
+const TimeFormatBackend time_format_backend_locale =
+{
+  .name = "locale",
+  .get_format = time_converter_get_locale_format,
+  .peek_format = locale_peek_format,
+  .finalize = locale_finalize
+};
+
+static const TimeFormatBackend *
+get_backend (void)
+{
+  const TimeFormatBackend *current = atomic_load (&backend);
+
+  if (current != NULL)
+    return current;
+
+  return (&time_format_backend_dbus != NULL) ?
+          &time_format_backend_dbus : &time_format_backend_locale;
+}
+
+void
+time_converter_set_backend (const TimeFormatBackend *new_backend)
+{
+  const TimeFormatBackend *old_backend = get_backend ();
+
+  atomic_store (&backend, new_backend);
+
+  if (old_backend != get_backend ())
+    old_backend->finalize ();
 }
 
 TimeFormat
 time_converter_get_format (void)
 {
-  static int checked = 0;
-  static TimeFormat format = TIME_FORMAT_TWENTYFOUR;
-
-  // First, try to get the time format using a DBus call
-  if (!checked)
-    if (time_converter_get_format_using_dbus (&format) == EXIT_SUCCESS)
-      return format;
+  return get_backend ()->get_format ();
+}
 
-  // If DBus call to get the time format fails, use c functions instead
-  if (!checked)
-    if (time_converter_get_format_using_c_calls (&format) == EXIT_SUCCESS)
-      return format;
+TimeFormat
+time_converter_peek_format (void)
+{
+  return get_backend ()->peek_format ();
+}
 
-  return format;
+void
+time_converter_finalize (void)
+{
+  get_backend ()->finalize ();
 }
 
 int
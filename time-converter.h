@@ -35,7 +35,42 @@ typedef enum
   PERIOD_PM
 } Period;
 
+// Where the clock format comes from
+typedef struct
+{
+  const char *name;
+  TimeFormat (*get_format) (void);    // may block briefly, the first time
+  TimeFormat (*peek_format) (void);   // last known format, never blocks
+  void (*finalize) (void);            // drops any cached state
+} TimeFormatBackend;
+
+// The locale's format (LC_TIME), using only libc; probed once and cached
+extern const TimeFormatBackend time_format_backend_locale;
+
+/*
+ * Selects the backend; NULL restores the default, which is the DBus backend
+ * when it's built in (see time-format-dbus.h), or else the locale one
+ */
+void time_converter_set_backend (const TimeFormatBackend *backend);
+
+/*
+ * The clock format, probed once and then cached by the backend. With the
+ * DBus backend, the first call blocks until the settings portal answers,
+ * for up to a second; while time_converter_peek_format () is probing in the
+ * background, it returns the locale format without blocking. Code that
+ * must never block (e.g. a UI thread) should use
+ * time_converter_peek_format () instead.
+ */
 TimeFormat time_converter_get_format (void);
+/*
+ * Last known format, without blocking; backends that probe in the
+ * background return the locale format until they know better
+ */
+TimeFormat time_converter_peek_format (void);
+// Drops the backend's cached state; the next call probes again
+void time_converter_finalize (void);
+
+TimeFormat time_converter_get_locale_format (void);
 
 int time_converter_to_twelve_format (uint8_t  hour24,
                                      uint8_t *hour12,
@@ -0,0 +1,356 @@
+/* time-format-dbus.c
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "time-format-dbus.h"
+
+#include "debugger.h"
+
+#include <stdlib.h>
+#include <gio/gio.h>
+
+#define PORTAL_BUS_NAME             "org.freedesktop.portal.Desktop"
+#define PORTAL_OBJECT_PATH          "/org/freedesktop/portal/desktop"
+#define PORTAL_SETTINGS_INTERFACE   "org.freedesktop.portal.Settings"
+#define PORTAL_METHOD_NAME          "Read"
+#define CLOCK_FORMAT_SCHEMA         "org.gnome.desktop.interface"
+#define CLOCK_FORMAT_PROPERTY_NAME  "clock-format"
+
+#define SETTING_CHANGED_SIGNAL      "SettingChanged"
+#define FORMAT_PROBE_TIMEOUT_MS     1000
+
+typedef enum
+{
+  FORMAT_UNKNOWN,     // never probed
+  FORMAT_PROBING,     // locale fallback, waiting for the desktop settings
+  FORMAT_KNOWN        // probed; kept current by SettingChanged
+} FormatState;
+
+/*
+ * Clock format of the desktop settings, read through the settings portal.
+ * The format is probed once and cached; the subscription to the portal's
+ * SettingChanged signal updates it afterwards. Signals and asynchronous
+ * replies are dispatched by the main context of the thread that probed.
+ */
+G_LOCK_DEFINE_STATIC (clock_format);
+static FormatState format_state = FORMAT_UNKNOWN;
+static TimeFormat cached_format = TIME_FORMAT_TWENTYFOUR;
+static GDBusConnection *settings_bus = NULL;
+static guint settings_subscription = 0;
+
+static void
+set_format (TimeFormat  format,
+            FormatState state)
+{
+  G_LOCK (clock_format);
+  cached_format = format;
+  format_state = state;
+  G_UNLOCK (clock_format);
+}
+
+// Setting values may come wrapped in one or more variants
+static gboolean
+variant_to_format (GVariant   *value,
+                   TimeFormat *format)
+{
+  g_autoptr (GVariant) inner = g_variant_ref (value);
+  const gchar *time_format;
+
+  while (g_variant_is_of_type (inner, G_VARIANT_TYPE_VARIANT))
+    {
+      GVariant *child = g_variant_get_variant (inner);
+      g_variant_unref (inner);
+      inner = child;
+    }
+
+  if (!g_variant_is_of_type (inner, G_VARIANT_TYPE_STRING))
+    return FALSE;
+
+  time_format = g_variant_get_string (inner, NULL);
+
+  DEBUG_PRINT (("[info]: DBus Setting time format: %s", time_format));
+
+  *format = (g_strcmp0 (time_format, "12h") == 0) ?
+             TIME_FORMAT_TWELVE : TIME_FORMAT_TWENTYFOUR;
+
+  return TRUE;
+}
+
+static void
+on_setting_changed (GDBusConnection *connection,
+                    const gchar     *sender_name,
+                    const gchar     *object_path,
+                    const gchar     *interface_name,
+                    const gchar     *signal_name,
+                    GVariant        *parameters,
+                    gpointer         user_data)
+{
+  g_autoptr (GVariant) value = NULL;
+  const gchar *namespace, *key;
+  TimeFormat format;
+
+  (void) connection;
+  (void) sender_name;
+  (void) object_path;
+  (void) interface_name;
+  (void) signal_name;
+  (void) user_data;
+
+  if (!g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(ssv)")))
+    return;
+
+  g_variant_get (parameters, "(&s&sv)", &namespace, &key, &value);
+
+  if (g_strcmp0 (namespace, CLOCK_FORMAT_SCHEMA) == 0
+      && g_strcmp0 (key, CLOCK_FORMAT_PROPERTY_NAME) == 0
+      && variant_to_format (value, &format))
+    set_format (format, FORMAT_KNOWN);
+}
+
+static void
+subscribe (GDBusConnection *bus)
+{
+  G_LOCK (clock_format);
+  if (settings_bus == NULL)
+    {
+      settings_bus = g_object_ref (bus);
+      settings_subscription =
+        g_dbus_connection_signal_subscribe (settings_bus,
+                                            PORTAL_BUS_NAME,
+                                            PORTAL_SETTINGS_INTERFACE,
+                                            SETTING_CHANGED_SIGNAL,
+                                            PORTAL_OBJECT_PATH,
+                                            CLOCK_FORMAT_SCHEMA,   // arg0: namespace
+                                            G_DBUS_SIGNAL_FLAGS_NONE,
+                                            on_setting_changed,
+                                            NULL,
+                                            NULL);
+    }
+  G_UNLOCK (clock_format);
+}
+
+static GVariant *
+read_parameters (void)
+{
+  return g_variant_new ("(ss)", CLOCK_FORMAT_SCHEMA, CLOCK_FORMAT_PROPERTY_NAME);
+}
+
+// See https://gitlab.gnome.org/GNOME/gnome-clocks/-/blob/master/src/utils.vala?ref_type=heads#L223
+static int
+read_format (TimeFormat *format)
+{
+  g_autoptr (GDBusConnection) connection = NULL;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GVariant) result = NULL;
+  g_autoptr (GVariant) value = NULL;
+
+  connection = g_bus_get_sync (G_BUS_TYPE_SESSION,
+                               NULL,
+                               &error);
+
+  if (error != NULL)
+    {
+      DEBUG_PRINT (("[warning]: Failed to get time format using DBus - connection error: %s",
+                    error->message));
+      return EXIT_FAILURE;
+    }
+
+  // Subscribe first, so no change is missed after the read
+  subscribe (connection);
+
+  result = g_dbus_connection_call_sync (connection,
+                                        PORTAL_BUS_NAME,
+                                        PORTAL_OBJECT_PATH,
+                                        PORTAL_SETTINGS_INTERFACE,
+                                        PORTAL_METHOD_NAME,
+                                        read_parameters (),
+                                        G_VARIANT_TYPE ("(v)"),
+                                        G_DBUS_CALL_FLAGS_NONE,
+                                        FORMAT_PROBE_TIMEOUT_MS,
+                                        NULL,
+                                        &error);
+
+  if (error != NULL)
+    {
+      DEBUG_PRINT (("[warning]: Failed to get time format using DBus - method call error: %s",
+                    error->message));
+      return EXIT_FAILURE;
+    }
+
+  g_variant_get (result, "(v)", &value);
+
+  return variant_to_format (value, format) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void
+on_read_ready (GObject      *source,
+               GAsyncResult *res,
+               gpointer      user_data)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GVariant) result = NULL;
+  g_autoptr (GVariant) value = NULL;
+  TimeFormat format;
+
+  (void) user_data;
+
+  result = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), res, &error);
+
+  if (error != NULL)
+    {
+      DEBUG_PRINT (("[warning]: Failed to get time format using DBus - method call error: %s",
+                    error->message));
+      // Keep the locale fallback; a SettingChanged signal may still update it
+      G_LOCK (clock_format);
+      format_state = FORMAT_KNOWN;
+      G_UNLOCK (clock_format);
+      return;
+    }
+
+  g_variant_get (result, "(v)", &value);
+
+  if (variant_to_format (value, &format))
+    set_format (format, FORMAT_KNOWN);
+}
+
+static void
+on_bus_ready (GObject      *source,
+              GAsyncResult *res,
+              gpointer      user_data)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GDBusConnection) connection = NULL;
+
+  (void) source;
+  (void) user_data;
+
+  connection = g_bus_get_finish (res, &error);
+
+  if (error != NULL)
+    {
+      DEBUG_PRINT (("[warning]: Failed to get time format using DBus - connection error: %s",
+                    error->message));
+      G_LOCK (clock_format);
+      format_state = FORMAT_KNOWN;
+      G_UNLOCK (clock_format);
+      return;
+    }
+
+  subscribe (connection);
+
+  g_dbus_connection_call (connection,
+                          PORTAL_BUS_NAME,
+                          PORTAL_OBJECT_PATH,
+                          PORTAL_SETTINGS_INTERFACE,
+                          PORTAL_METHOD_NAME,
+                          read_parameters (),
+                          G_VARIANT_TYPE ("(v)"),
+                          G_DBUS_CALL_FLAGS_NONE,
+                          FORMAT_PROBE_TIMEOUT_MS,
+                          NULL,
+                          on_read_ready,
+                          NULL);
+}
+
+// Sets the locale fallback and returns true if the caller must probe DBus
+static gboolean
+start_probe (void)
+{
+  TimeFormat format;
+
+  G_LOCK (clock_format);
+  if (format_state != FORMAT_UNKNOWN)
+    {
+      G_UNLOCK (clock_format);
+      return FALSE;
+    }
+  format_state = FORMAT_PROBING;
+  G_UNLOCK (clock_format);
+
+  format = time_converter_get_locale_format ();
+  G_LOCK (clock_format);
+  // The probe may have finished already
+  if (format_state == FORMAT_PROBING)
+    cached_format = format;
+  G_UNLOCK (clock_format);
+
+  return TRUE;
+}
+
+static TimeFormat
+dbus_get_format (void)
+{
+  TimeFormat format;
+
+  // If the DBus call fails, the locale format is kept
+  if (start_probe ())
+    {
+      if (read_format (&format) == EXIT_SUCCESS)
+        set_format (format, FORMAT_KNOWN);
+      else
+        {
+          G_LOCK (clock_format);
+          format_state = FORMAT_KNOWN;
+          G_UNLOCK (clock_format);
+        }
+    }
+
+  G_LOCK (clock_format);
+  format = cached_format;
+  G_UNLOCK (clock_format);
+
+  return format;
+}
+
+static TimeFormat
+dbus_peek_format (void)
+{
+  TimeFormat format;
+
+  if (start_probe ())
+    g_bus_get (G_BUS_TYPE_SESSION, NULL, on_bus_ready, NULL);
+
+  G_LOCK (clock_format);
+  format = cached_format;
+  G_UNLOCK (clock_format);
+
+  return format;
+}
+
+static void
+dbus_finalize (void)
+{
+  G_LOCK (clock_format);
+  if (settings_bus != NULL)
+    {
+      g_dbus_connection_signal_unsubscribe (settings_bus, settings_subscription);
+      g_clear_object (&settings_bus);
+      settings_subscription = 0;
+    }
+  format_state = FORMAT_UNKNOWN;
+  G_UNLOCK (clock_format);
+}
+
+const TimeFormatBackend time_format_backend_dbus =
+{
+  .name = "dbus",
+  .get_format = dbus_get_format,
+  .peek_format = dbus_peek_format,
+  .finalize = dbus_finalize
+};
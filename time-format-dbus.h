@@ -0,0 +1,37 @@
+/* time-format-dbus.h
+ *
+ * Copyright 2021-2025 Kelvin Novais
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef TIME_FORMAT_DBUS_H_
+#define TIME_FORMAT_DBUS_H_
+
+#include "time-converter.h"
+
+/*
+ * The clock format of the desktop settings (org.gnome.desktop.interface
+ * clock-format), read through the settings portal with a bounded timeout,
+ * then kept current by its SettingChanged signal. get_format probes
+ * synchronously on its first call, blocking for up to FORMAT_PROBE_TIMEOUT_MS
+ * (1 s); peek_format never blocks and probes in the background, which needs
+ * the caller's GLib main context to be running.
+ * Falls back to the locale's format. Requires gio-2.0.
+ */
+extern const TimeFormatBackend time_format_backend_dbus;
+
+#endif /* TIME_FORMAT_DBUS_H_ */